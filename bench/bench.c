@@ -0,0 +1,469 @@
+/*
+ * Throughput and latency benchmarks for the storage engine.
+ *
+ * The engine is driven through libdb, the same calls the REPL makes,
+ * without parsing or printing. Each run prints one CSV line per workload:
+ *
+ *   workload,rows,cache_pages,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns
+ *
+ * By default every workload runs for each combination of BENCH_ROWS and
+ * BENCH_CACHE_PAGES. --rows=N and --cache-pages=N restrict the run to a
+ * single size.
+ *
+ * --threads=N adds workloads that share one table between N reader
+ * threads, with and without a writer inserting at the same time. Their
+ * seconds are wall-clock time, so ops_per_sec is the combined rate.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libdb.h"
+
+#define BENCH_FILENAME "bench.db"
+#define BENCH_WAL_FILENAME "bench.db-wal"
+/*
+Commits are synced in the background, batched, so the numbers are not
+just fdatasync() latency
+*/
+#define BENCH_DEFAULT_COMMIT_INTERVAL_MS 10
+/* Rows per explicit transaction in batched_insert */
+#define BENCH_BATCH_ROWS 1000
+
+const uint32_t BENCH_ROWS[] = {10000, 100000};
+const uint32_t BENCH_CACHE_PAGES[] = {100, 1000};
+
+typedef struct {
+  const char* workload;
+  uint32_t rows;
+  uint32_t cache_pages;
+  uint32_t threads;
+  uint64_t* samples;  // latency of each op in nanoseconds
+  uint32_t num_samples;
+  uint64_t total_ns;
+} BenchResult;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_samples(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+void bench_report(BenchResult* result) {
+  qsort(result->samples, result->num_samples, sizeof(uint64_t),
+        compare_samples);
+  uint64_t p50 = result->samples[result->num_samples * 50 / 100];
+  uint64_t p99 = result->samples[result->num_samples * 99 / 100];
+  double seconds = result->total_ns / 1e9;
+  printf("%s,%u,%u,%u,%u,%.6f,%.0f,%lu,%lu\n", result->workload, result->rows,
+         result->cache_pages, result->threads, result->num_samples, seconds,
+         result->num_samples / seconds, p50, p99);
+  fflush(stdout);
+}
+
+void shuffle_keys(uint32_t* keys, uint32_t n) {
+  for (uint32_t i = n - 1; i > 0; i--) {
+    uint32_t j = rand() % (i + 1);
+    uint32_t tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+Table* bench_open(DbOptions* options) {
+  unlink(BENCH_FILENAME);
+  unlink(BENCH_WAL_FILENAME);
+  return db_open(BENCH_FILENAME, options);
+}
+
+/*
+With batch_rows of 1 each insert is its own transaction. Otherwise
+every batch_rows inserts share one, and the commit is counted in the
+last insert's latency. prepared inserts through a prepared statement
+bound to the formatted strings instead of a Row.
+*/
+void bench_insert(BenchResult* result, Table* table, uint32_t* keys,
+                  uint32_t batch_rows, bool prepared) {
+  Row row;
+  DbStatement* statement = prepared ? db_prepare_insert(table) : NULL;
+  for (uint32_t i = 0; i < result->rows; i++) {
+    row.id = keys[i];
+    int username_length = snprintf(row.username, sizeof(row.username),
+                                   "user%u", keys[i]);
+    int email_length = snprintf(row.email, sizeof(row.email),
+                                "person%u@example.com", keys[i]);
+
+    uint64_t start = now_ns();
+    if (batch_rows > 1 && i % batch_rows == 0) {
+      db_begin(table);
+    }
+    DbResult inserted;
+    if (prepared) {
+      db_bind_id(statement, row.id);
+      db_bind_text(statement, DB_COLUMN_USERNAME, row.username,
+                   username_length);
+      db_bind_text(statement, DB_COLUMN_EMAIL, row.email, email_length);
+      inserted = db_step(statement);
+    } else {
+      inserted = db_insert(table, &row);
+    }
+    if (inserted != DB_SUCCESS) {
+      printf("Benchmark insert of key %u failed.\n", keys[i]);
+      exit(EXIT_FAILURE);
+    }
+    if (batch_rows > 1 &&
+        (i % batch_rows == batch_rows - 1 || i == result->rows - 1)) {
+      db_commit(table);
+    }
+    result->samples[i] = now_ns() - start;
+    result->total_ns += result->samples[i];
+  }
+  result->num_samples = result->rows;
+  if (statement != NULL) {
+    db_finalize(statement);
+  }
+}
+
+void bench_point_lookup(BenchResult* result, Table* table, uint32_t* keys) {
+  Row row;
+  for (uint32_t i = 0; i < result->rows; i++) {
+    uint64_t start = now_ns();
+    DbResult found = db_get(table, keys[i], &row);
+    result->samples[i] = now_ns() - start;
+    result->total_ns += result->samples[i];
+
+    if (found != DB_SUCCESS || row.id != keys[i]) {
+      printf("Benchmark lookup of key %u found %u.\n", keys[i], row.id);
+      exit(EXIT_FAILURE);
+    }
+  }
+  result->num_samples = result->rows;
+}
+
+/* Looks up each key's row by its email, through the email index */
+void bench_email_lookup(BenchResult* result, Table* table, uint32_t* keys) {
+  Row row;
+  char email[COLUMN_EMAIL_SIZE + 1];
+  for (uint32_t i = 0; i < result->rows; i++) {
+    snprintf(email, sizeof(email), "person%u@example.com", keys[i]);
+    uint64_t start = now_ns();
+    uint32_t num_found = db_find(table, DB_COLUMN_EMAIL, email, &row, 1);
+    result->samples[i] = now_ns() - start;
+    result->total_ns += result->samples[i];
+
+    if (num_found != 1 || row.id != keys[i]) {
+      printf("Benchmark lookup of email %s found %u rows.\n", email,
+             num_found);
+      exit(EXIT_FAILURE);
+    }
+  }
+  result->num_samples = result->rows;
+}
+
+/* One op is one row of a full scan */
+void bench_scan(BenchResult* result, Table* table) {
+  Row row;
+  uint32_t num_rows = 0;
+  uint64_t start = now_ns();
+  Cursor* cursor = db_cursor_open(table, 0);
+  while (db_cursor_next(cursor, &row)) {
+    uint64_t end = now_ns();
+    result->samples[num_rows++] = end - start;
+    result->total_ns += end - start;
+    start = end;
+  }
+  db_cursor_close(cursor);
+
+  if (num_rows != result->rows) {
+    printf("Benchmark scan saw %u rows, expected %u.\n", num_rows,
+           result->rows);
+    exit(EXIT_FAILURE);
+  }
+  result->num_samples = num_rows;
+}
+
+/*
+One op is one range covering BENCH_RANGE_PERMILLE of the keys,
+starting at a random key.
+*/
+#define BENCH_RANGE_PERMILLE 1
+
+void bench_range_scan(BenchResult* result, Table* table, uint32_t* keys) {
+  uint32_t width = result->rows * BENCH_RANGE_PERMILLE / 1000;
+  if (width == 0) {
+    width = 1;
+  }
+
+  Row row;
+  for (uint32_t i = 0; i < result->rows; i++) {
+    uint32_t first_id = keys[i];
+    uint32_t num_rows = 0;
+    uint64_t start = now_ns();
+    Cursor* cursor = db_cursor_open_range(table, first_id, first_id + width - 1);
+    while (db_cursor_next(cursor, &row)) {
+      num_rows++;
+    }
+    db_cursor_close(cursor);
+    result->samples[i] = now_ns() - start;
+    result->total_ns += result->samples[i];
+
+    uint32_t expected = width;
+    if (first_id + width - 1 > result->rows) {
+      expected = result->rows - first_id + 1;
+    }
+    if (num_rows != expected) {
+      printf("Benchmark range at key %u saw %u rows, expected %u.\n",
+             first_id, num_rows, expected);
+      exit(EXIT_FAILURE);
+    }
+  }
+  result->num_samples = result->rows;
+}
+
+typedef struct {
+  Table* table;
+  uint32_t* keys;
+  uint32_t num_keys;
+  uint64_t* samples;
+} LookupWorker;
+
+void* lookup_worker_main(void* argument) {
+  LookupWorker* worker = argument;
+  Row row;
+  for (uint32_t i = 0; i < worker->num_keys; i++) {
+    uint32_t key = worker->keys[i];
+    uint64_t start = now_ns();
+    DbResult found = db_get(worker->table, key, &row);
+    worker->samples[i] = now_ns() - start;
+
+    if (found != DB_SUCCESS || row.id != key) {
+      printf("Benchmark lookup of key %u found %u.\n", key, row.id);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+typedef struct {
+  Table* table;
+  uint32_t first_id;
+  volatile bool stop;
+} InsertWorker;
+
+void* insert_worker_main(void* argument) {
+  InsertWorker* worker = argument;
+  Row row;
+  for (uint32_t id = worker->first_id; !worker->stop; id++) {
+    row.id = id;
+    snprintf(row.username, sizeof(row.username), "user%u", id);
+    snprintf(row.email, sizeof(row.email), "person%u@example.com", id);
+    db_insert(worker->table, &row);
+  }
+  return NULL;
+}
+
+/*
+The keys are split between result->threads readers, which all look
+up their share at once. With with_writer set, another thread keeps
+inserting new rows past the end of the table until they are done.
+*/
+void bench_parallel_lookup(BenchResult* result, Table* table, uint32_t* keys,
+                           bool with_writer) {
+  uint32_t num_threads = result->threads;
+  pthread_t threads[num_threads];
+  LookupWorker workers[num_threads];
+  InsertWorker writer = {table, result->rows + 1, false};
+  pthread_t writer_thread;
+  if (with_writer) {
+    pthread_create(&writer_thread, NULL, insert_worker_main, &writer);
+  }
+
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < num_threads; i++) {
+    uint32_t first = result->rows / num_threads * i;
+    uint32_t end = result->rows / num_threads * (i + 1);
+    if (i == num_threads - 1) {
+      end = result->rows;
+    }
+    workers[i].table = table;
+    workers[i].keys = keys + first;
+    workers[i].num_keys = end - first;
+    workers[i].samples = result->samples + first;
+    pthread_create(&threads[i], NULL, lookup_worker_main, &workers[i]);
+  }
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  result->total_ns = now_ns() - start;
+  result->num_samples = result->rows;
+
+  if (with_writer) {
+    writer.stop = true;
+    pthread_join(writer_thread, NULL);
+  }
+}
+
+/*
+Drop the db file from the OS page cache, so the next scan has to go
+to the disk. Only clean pages are dropped, so the file is synced first.
+*/
+void bench_drop_file_cache() {
+  int fd = open(BENCH_FILENAME, O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+void bench_run(uint32_t rows, DbOptions* options, uint32_t threads) {
+  uint32_t* keys = malloc(rows * sizeof(uint32_t));
+  BenchResult result;
+  result.rows = rows;
+  result.cache_pages = options->cache_pages;
+  result.threads = 1;
+  result.samples = malloc(rows * sizeof(uint64_t));
+
+  for (uint32_t i = 0; i < rows; i++) {
+    keys[i] = i + 1;
+  }
+
+  Table* table = bench_open(options);
+  result.workload = "sequential_insert";
+  result.total_ns = 0;
+  bench_insert(&result, table, keys, 1, false);
+  bench_report(&result);
+
+  shuffle_keys(keys, rows);
+  result.workload = "point_lookup";
+  result.total_ns = 0;
+  bench_point_lookup(&result, table, keys);
+  bench_report(&result);
+
+  result.workload = "scan";
+  result.total_ns = 0;
+  bench_scan(&result, table);
+  bench_report(&result);
+
+  result.workload = "range_scan";
+  result.total_ns = 0;
+  bench_range_scan(&result, table, keys);
+  bench_report(&result);
+
+  if (threads > 0) {
+    result.threads = threads;
+    result.workload = "parallel_lookup";
+    bench_parallel_lookup(&result, table, keys, false);
+    bench_report(&result);
+
+    result.workload = "parallel_lookup_with_writer";
+    bench_parallel_lookup(&result, table, keys, true);
+    bench_report(&result);
+    result.threads = 1;
+  }
+
+  db_create_index(table, DB_COLUMN_EMAIL);
+  result.workload = "email_lookup";
+  result.total_ns = 0;
+  bench_email_lookup(&result, table, keys);
+  bench_report(&result);
+  db_close(table);
+
+  bench_drop_file_cache();
+  table = db_open(BENCH_FILENAME, options);
+  result.workload = "cold_scan";
+  result.total_ns = 0;
+  bench_scan(&result, table);
+  bench_report(&result);
+  db_close(table);
+
+  table = bench_open(options);
+  result.workload = "random_insert";
+  result.total_ns = 0;
+  bench_insert(&result, table, keys, 1, false);
+  bench_report(&result);
+  db_close(table);
+
+  table = bench_open(options);
+  result.workload = "batched_insert";
+  result.total_ns = 0;
+  bench_insert(&result, table, keys, BENCH_BATCH_ROWS, false);
+  bench_report(&result);
+  db_close(table);
+
+  table = bench_open(options);
+  result.workload = "prepared_batched_insert";
+  result.total_ns = 0;
+  bench_insert(&result, table, keys, BENCH_BATCH_ROWS, true);
+  bench_report(&result);
+  db_close(table);
+
+  unlink(BENCH_FILENAME);
+  free(result.samples);
+  free(keys);
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t rows = 0;
+  uint32_t cache_pages = 0;
+  uint32_t threads = 0;
+  DbOptions options = default_db_options();
+  options.commit_interval_ms = BENCH_DEFAULT_COMMIT_INTERVAL_MS;
+  options.async_commit = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--rows=", 7) == 0) {
+      rows = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--cache-pages=", 14) == 0) {
+      cache_pages = atoi(argv[i] + 14);
+    } else if (strncmp(argv[i], "--commit-interval-ms=", 21) == 0) {
+      options.commit_interval_ms = atoi(argv[i] + 21);
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = atoi(argv[i] + 10);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    } else if (strncmp(argv[i], "--readahead-pages=", 18) == 0) {
+      options.readahead_pages = atoi(argv[i] + 18);
+    } else if (strcmp(argv[i], "--compress-wal") == 0) {
+      options.compress_wal = true;
+    } else {
+      printf("Unrecognized argument '%s'.\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const uint32_t* row_counts = BENCH_ROWS;
+  size_t num_row_counts = sizeof(BENCH_ROWS) / sizeof(BENCH_ROWS[0]);
+  if (rows != 0) {
+    row_counts = &rows;
+    num_row_counts = 1;
+  }
+  const uint32_t* cache_sizes = BENCH_CACHE_PAGES;
+  size_t num_cache_sizes =
+      sizeof(BENCH_CACHE_PAGES) / sizeof(BENCH_CACHE_PAGES[0]);
+  if (cache_pages != 0) {
+    cache_sizes = &cache_pages;
+    num_cache_sizes = 1;
+  }
+
+  printf(
+      "workload,rows,cache_pages,threads,ops,seconds,ops_per_sec,p50_ns,"
+      "p99_ns\n");
+  srand(42);
+  for (size_t r = 0; r < num_row_counts; r++) {
+    for (size_t c = 0; c < num_cache_sizes; c++) {
+      options.cache_pages = cache_sizes[c];
+      bench_run(row_counts[r], &options, threads);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,2400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "btree.h"
+
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+
+/*
+ * Row Layout
+ * Strings are stored at their actual length, each with a one-byte size
+ * up front. The email follows straight after the username.
+ */
+const uint32_t ID_SIZE = size_of_attribute(Row, id);
+const uint32_t STRING_SIZE_SIZE = sizeof(uint8_t);
+const uint32_t ID_OFFSET = 0;
+const uint32_t USERNAME_SIZE_OFFSET = ID_OFFSET + ID_SIZE;
+const uint32_t EMAIL_SIZE_OFFSET = USERNAME_SIZE_OFFSET + STRING_SIZE_SIZE;
+const uint32_t USERNAME_OFFSET = EMAIL_SIZE_OFFSET + STRING_SIZE_SIZE;
+const uint32_t ROW_MIN_SIZE = USERNAME_OFFSET;
+const uint32_t ROW_MAX_SIZE =
+    USERNAME_OFFSET + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
+
+/*
+ * Common Node Header Layout
+ */
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
+const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE =
+    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+
+/*
+ * Internal Node Header Layout
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                           INTERNAL_NODE_NUM_KEYS_SIZE +
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
+/*
+ * Internal Node Body Layout
+ * A cell is a child and the max key under it, but the keys and the
+ * children are kept in two separate arrays. A search only reads the
+ * keys, which sit together in a few cache lines. The key array starts
+ * on a 16-byte boundary so it can be loaded in vectors.
+ */
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_KEYS_OFFSET =
+    (INTERNAL_NODE_HEADER_SIZE + 15) / 16 * 16;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS =
+    PAGE_USABLE_SIZE - INTERNAL_NODE_KEYS_OFFSET;
+const uint32_t INTERNAL_NODE_MAX_CELLS =
+    INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+const uint32_t INTERNAL_NODE_CHILDREN_OFFSET =
+    INTERNAL_NODE_KEYS_OFFSET +
+    INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
+/* Searches switch from bisecting to scanning a block this many keys wide */
+const uint32_t INTERNAL_NODE_SEARCH_BLOCK = 32;
+/*
+ * An index tree's keys are 64 bits wide (see index.h). Its internal
+ * nodes keep them in the same key array, so they hold half as many.
+ */
+const uint32_t INDEX_INTERNAL_NODE_KEY_SIZE = sizeof(uint64_t);
+const uint32_t INDEX_INTERNAL_NODE_MAX_CELLS =
+    INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE /
+    INDEX_INTERNAL_NODE_KEY_SIZE;
+
+/*
+ * Leaf Node Header Layout
+ */
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+    LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE;
+
+/*
+ * Leaf Node Body Layout
+ * An array of slots, one per cell in key order, grows up from the
+ * header. Each slot holds the offset of its cell. The cells themselves
+ * are packed together at the end of the page, just before the page's
+ * checksum, growing down to the content start. A cell is a serialized
+ * row, so it begins with the key.
+ */
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_KEY_SIZE = ID_SIZE;
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS =
+    PAGE_USABLE_SIZE - LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_MAX_CELL_SIZE = ROW_MAX_SIZE + LEAF_NODE_SLOT_SIZE;
+const uint32_t LEAF_NODE_MAX_CELLS =
+    LEAF_NODE_SPACE_FOR_CELLS / (ROW_MIN_SIZE + LEAF_NODE_SLOT_SIZE);
+
+/*
+Deletes keep every node except the root at least half full. For
+leaves that is measured in bytes, less one cell, since that is as
+evenly as cells of different sizes can be split between two leaves.
+*/
+const uint32_t LEAF_NODE_MIN_SPACE =
+    (LEAF_NODE_SPACE_FOR_CELLS - LEAF_NODE_MAX_CELL_SIZE) / 2;
+const uint32_t INTERNAL_NODE_MIN_CHILDREN = (INTERNAL_NODE_MAX_CELLS + 2) / 2;
+const uint32_t INDEX_INTERNAL_NODE_MIN_CHILDREN =
+    (INDEX_INTERNAL_NODE_MAX_CELLS + 2) / 2;
+
+NodeType get_node_type(void* node) {
+  uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+  return (NodeType)value;
+}
+
+void set_node_type(void* node, NodeType type) {
+  uint8_t value = type;
+  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+bool is_node_root(void* node) {
+  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+  return (bool)value;
+}
+
+void set_node_root(void* node, bool is_root) {
+  uint8_t value = is_root;
+  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+uint32_t* node_parent(void* node) { return node + PARENT_POINTER_OFFSET; }
+
+uint32_t* internal_node_num_keys(void* node) {
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint32_t* internal_node_right_child(void* node) {
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t* internal_node_keys(void* node) {
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+uint64_t* index_internal_node_keys(void* node) {
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+uint32_t* internal_node_children(void* node) {
+  return node + INTERNAL_NODE_CHILDREN_OFFSET;
+}
+
+uint32_t internal_node_max_cells(Table* table) {
+  return table->is_index ? INDEX_INTERNAL_NODE_MAX_CELLS
+                         : INTERNAL_NODE_MAX_CELLS;
+}
+
+uint32_t internal_node_min_children(Table* table) {
+  return table->is_index ? INDEX_INTERNAL_NODE_MIN_CHILDREN
+                         : INTERNAL_NODE_MIN_CHILDREN;
+}
+
+/* The largest key the tree can hold */
+uint64_t table_max_key(Table* table) {
+  return table->is_index ? UINT64_MAX : UINT32_MAX;
+}
+
+/* Copy count cells between two nodes, or within one */
+void internal_node_move_cells(Table* table, void* destination,
+                              uint32_t destination_num, void* source,
+                              uint32_t source_num, uint32_t count) {
+  uint32_t key_size =
+      table->is_index ? INDEX_INTERNAL_NODE_KEY_SIZE : INTERNAL_NODE_KEY_SIZE;
+  memmove((void*)internal_node_keys(destination) + destination_num * key_size,
+          (void*)internal_node_keys(source) + source_num * key_size,
+          count * key_size);
+  memmove(internal_node_children(destination) + destination_num,
+          internal_node_children(source) + source_num,
+          count * INTERNAL_NODE_CHILD_SIZE);
+}
+
+uint32_t* internal_node_child(void* node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys) {
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    exit(EXIT_FAILURE);
+  } else if (child_num == num_keys) {
+    return internal_node_right_child(node);
+  } else {
+    return internal_node_children(node) + child_num;
+  }
+}
+
+uint64_t internal_node_key(Table* table, void* node, uint32_t key_num) {
+  if (table->is_index) {
+    return index_internal_node_keys(node)[key_num];
+  }
+  return internal_node_keys(node)[key_num];
+}
+
+void internal_node_set_key(Table* table, void* node, uint32_t key_num,
+                           uint64_t key) {
+  if (table->is_index) {
+    index_internal_node_keys(node)[key_num] = key;
+  } else {
+    internal_node_keys(node)[key_num] = key;
+  }
+}
+
+uint32_t* leaf_node_num_cells(void* node) {
+  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t* leaf_node_next_leaf(void* node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+uint32_t* leaf_node_content_start(void* node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint16_t* leaf_node_slot(void* node, uint32_t cell_num) {
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+void* leaf_node_cell(void* node, uint32_t cell_num) {
+  return node + *leaf_node_slot(node, cell_num);
+}
+
+uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+  return leaf_node_cell(node, cell_num) + ID_OFFSET;
+}
+
+void* leaf_node_value(void* node, uint32_t cell_num) {
+  return leaf_node_cell(node, cell_num);
+}
+
+/* An index entry's key: the value's hash above the indexed row's id */
+uint64_t index_entry_key(void* cell) {
+  uint32_t hash;
+  memcpy(&hash, cell + USERNAME_OFFSET, sizeof(hash));
+  return (uint64_t)hash << 32 | *(uint32_t*)(cell + ID_OFFSET);
+}
+
+/* The key the tree orders the cell by */
+uint64_t leaf_node_cell_key(Table* table, void* node, uint32_t cell_num) {
+  if (table->is_index) {
+    return index_entry_key(leaf_node_cell(node, cell_num));
+  }
+  return *leaf_node_key(node, cell_num);
+}
+
+void print_constants() {
+  printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+/*
+The max key of an internal node is the max key of its
+rightmost descendant, since the right child has no key of its own.
+*/
+uint64_t get_node_max_key(Table* table, void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_cell_key(table, node, *leaf_node_num_cells(node) - 1);
+  }
+
+  Pager* pager = table->pager;
+  uint32_t page_num = *internal_node_right_child(node);
+  while (true) {
+    void* child = get_page(pager, page_num);
+    if (get_node_type(child) == NODE_LEAF) {
+      uint64_t max_key =
+          leaf_node_cell_key(table, child, *leaf_node_num_cells(child) - 1);
+      unpin_page(pager, page_num, false);
+      return max_key;
+    }
+    uint32_t right_child_page_num = *internal_node_right_child(child);
+    unpin_page(pager, page_num, false);
+    page_num = right_child_page_num;
+  }
+}
+
+void indent(uint32_t level) {
+  for (uint32_t i = 0; i < level; i++) {
+    printf("  ");
+  }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node)) {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(indentation_level + 1);
+        printf("- %d\n", *leaf_node_key(node, i));
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        child = *internal_node_child(node, i);
+        print_tree(pager, child, indentation_level + 1);
+
+        indent(indentation_level + 1);
+        printf("- key %d\n", internal_node_keys(node)[i]);
+      }
+      child = *internal_node_right_child(node);
+      print_tree(pager, child, indentation_level + 1);
+      break;
+  }
+
+  unpin_page(pager, page_num, false);
+}
+
+uint32_t row_size(const RowFields* fields) {
+  return USERNAME_OFFSET + fields->username_size + fields->email_size;
+}
+
+void row_fields(const Row* row, RowFields* fields) {
+  fields->id = row->id;
+  fields->username = row->username;
+  fields->username_size = strlen(row->username);
+  fields->email = row->email;
+  fields->email_size = strlen(row->email);
+}
+
+uint32_t serialized_row_size(void* source) {
+  uint8_t username_size = *((uint8_t*)(source + USERNAME_SIZE_OFFSET));
+  uint8_t email_size = *((uint8_t*)(source + EMAIL_SIZE_OFFSET));
+  return USERNAME_OFFSET + username_size + email_size;
+}
+
+uint32_t serialize_row_fields(const RowFields* source, void* destination) {
+  uint8_t username_size = source->username_size;
+  uint8_t email_size = source->email_size;
+  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+  *((uint8_t*)(destination + USERNAME_SIZE_OFFSET)) = username_size;
+  *((uint8_t*)(destination + EMAIL_SIZE_OFFSET)) = email_size;
+  memcpy(destination + USERNAME_OFFSET, source->username, username_size);
+  memcpy(destination + USERNAME_OFFSET + username_size, source->email,
+         email_size);
+  return USERNAME_OFFSET + username_size + email_size;
+}
+
+uint32_t serialize_row(const Row* source, void* destination) {
+  RowFields fields;
+  row_fields(source, &fields);
+  return serialize_row_fields(&fields, destination);
+}
+
+void deserialize_row_fields(void* source, RowFields* destination) {
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  destination->username_size = *((uint8_t*)(source + USERNAME_SIZE_OFFSET));
+  destination->email_size = *((uint8_t*)(source + EMAIL_SIZE_OFFSET));
+  destination->username = source + USERNAME_OFFSET;
+  destination->email = source + USERNAME_OFFSET + destination->username_size;
+}
+
+void deserialize_row(void* source, Row* destination) {
+  uint8_t username_size = *((uint8_t*)(source + USERNAME_SIZE_OFFSET));
+  uint8_t email_size = *((uint8_t*)(source + EMAIL_SIZE_OFFSET));
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  memcpy(destination->username, source + USERNAME_OFFSET, username_size);
+  destination->username[username_size] = '\0';
+  memcpy(destination->email, source + USERNAME_OFFSET + username_size,
+         email_size);
+  destination->email[email_size] = '\0';
+}
+
+/* Drop every cell */
+void leaf_node_clear(void* node) {
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_content_start(node) = PAGE_USABLE_SIZE;
+}
+
+void initialize_leaf_node(void* node) {
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
+  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+  leaf_node_clear(node);
+}
+
+/* Bytes taken by a cell, counting its slot */
+uint32_t leaf_node_cell_size(void* node, uint32_t cell_num) {
+  return serialized_row_size(leaf_node_cell(node, cell_num)) +
+         LEAF_NODE_SLOT_SIZE;
+}
+
+uint32_t leaf_node_used_space(void* node) {
+  return *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE + PAGE_USABLE_SIZE -
+         *leaf_node_content_start(node);
+}
+
+uint32_t leaf_node_free_space(void* node) {
+  return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_used_space(node);
+}
+
+/*
+Make room for a cell of the given size (without its slot) at cell_num
+and return where its bytes go. The caller has checked that it fits.
+*/
+void* leaf_node_insert_cell(void* node, uint32_t cell_num, uint32_t size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t content_start = *leaf_node_content_start(node) - size;
+  memmove(leaf_node_slot(node, cell_num + 1), leaf_node_slot(node, cell_num),
+          (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+  *leaf_node_slot(node, cell_num) = content_start;
+  *leaf_node_content_start(node) = content_start;
+  *leaf_node_num_cells(node) = num_cells + 1;
+  return node + content_start;
+}
+
+void leaf_node_append_cell(void* node, void* cell) {
+  uint32_t size = serialized_row_size(cell);
+  memcpy(leaf_node_insert_cell(node, *leaf_node_num_cells(node), size), cell,
+         size);
+}
+
+/*
+Cells stay packed: the cells below the removed one move up to close
+the gap, and their slots follow.
+*/
+void leaf_node_remove_cell(void* node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t offset = *leaf_node_slot(node, cell_num);
+  uint32_t size = serialized_row_size(node + offset);
+  uint32_t content_start = *leaf_node_content_start(node);
+
+  memmove(node + content_start + size, node + content_start,
+          offset - content_start);
+  memmove(leaf_node_slot(node, cell_num), leaf_node_slot(node, cell_num + 1),
+          (num_cells - cell_num - 1) * LEAF_NODE_SLOT_SIZE);
+  num_cells--;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (*leaf_node_slot(node, i) < offset) {
+      *leaf_node_slot(node, i) += size;
+    }
+  }
+  *leaf_node_content_start(node) = content_start + size;
+  *leaf_node_num_cells(node) = num_cells;
+}
+
+/*
+Lay the given cells out over two empty leaves, splitting them where
+the two sides come closest to holding the same number of bytes.
+*/
+void leaf_node_distribute(void** cells, uint32_t num_cells, void* left,
+                          void* right) {
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    total += serialized_row_size(cells[i]) + LEAF_NODE_SLOT_SIZE;
+  }
+
+  uint32_t left_count = 0;
+  uint32_t left_bytes = 0;
+  while (left_count < num_cells - 1) {
+    uint32_t size =
+        serialized_row_size(cells[left_count]) + LEAF_NODE_SLOT_SIZE;
+    /* Take the cell while its middle still lies in the left half */
+    if (left_count > 0 && 2 * left_bytes + size > total) {
+      break;
+    }
+    left_bytes += size;
+    left_count++;
+  }
+
+  for (uint32_t i = 0; i < num_cells; i++) {
+    leaf_node_append_cell(i < left_count ? left : right, cells[i]);
+  }
+}
+
+void initialize_internal_node(void* node) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+}
+
+/*
+Point the cursor at the key's position in the leaf. The cursor takes
+over the shared latch the caller holds on the leaf.
+*/
+void leaf_node_find(Cursor* cursor, Table* table, uint32_t page_num,
+                    void* node, uint64_t key) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->node = node;
+  cursor->mode = CURSOR_LATCHED;
+  cursor->last_key = table_max_key(table);
+  cursor->leaves_visited = 1;
+  cursor->readahead_depth = 0;
+  cursor->readahead_ahead = 0;
+  cursor->end_of_table = false;
+
+  // Binary search
+  uint32_t min_index = 0;
+  uint32_t one_past_max_index = num_cells;
+  while (one_past_max_index != min_index) {
+    uint32_t index = (min_index + one_past_max_index) / 2;
+    uint64_t key_at_index = leaf_node_cell_key(table, node, index);
+    if (key == key_at_index) {
+      cursor->cell_num = index;
+      return;
+    }
+    if (key < key_at_index) {
+      one_past_max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+
+  cursor->cell_num = min_index;
+}
+
+/*
+Count the keys below key among the first num_keys of a sorted array.
+The vector versions compare unsigned keys as signed ones with the top
+bit flipped, since SSE2 and AVX2 have no unsigned compare.
+*/
+typedef uint32_t (*CountKeysFunction)(const uint32_t* keys, uint32_t num_keys,
+                                      uint32_t key);
+
+uint32_t count_keys_below_scalar(const uint32_t* keys, uint32_t num_keys,
+                                 uint32_t key) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    count += keys[i] < key;
+  }
+  return count;
+}
+
+#if defined(__x86_64__)
+uint32_t count_keys_below_sse2(const uint32_t* keys, uint32_t num_keys,
+                               uint32_t key) {
+  __m128i sign = _mm_set1_epi32(INT32_MIN);
+  __m128i target = _mm_xor_si128(_mm_set1_epi32(key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= num_keys; i += 4) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(keys + i));
+    __m128i below = _mm_cmpgt_epi32(target, _mm_xor_si128(block, sign));
+    count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(below)));
+  }
+  return count + count_keys_below_scalar(keys + i, num_keys - i, key);
+}
+
+__attribute__((target("avx2"))) uint32_t count_keys_below_avx2(
+    const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  __m256i sign = _mm256_set1_epi32(INT32_MIN);
+  __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 8 <= num_keys; i += 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(keys + i));
+    __m256i below = _mm256_cmpgt_epi32(target, _mm256_xor_si256(block, sign));
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(below)));
+  }
+  return count + count_keys_below_sse2(keys + i, num_keys - i, key);
+}
+#endif
+
+uint32_t count_keys_below_dispatch(const uint32_t* keys, uint32_t num_keys,
+                                   uint32_t key);
+
+/* Picked on first use from what the CPU supports */
+CountKeysFunction count_keys_below = count_keys_below_dispatch;
+
+uint32_t count_keys_below_dispatch(const uint32_t* keys, uint32_t num_keys,
+                                   uint32_t key) {
+  CountKeysFunction function = count_keys_below_scalar;
+#if defined(__x86_64__)
+  function = __builtin_cpu_supports("avx2") ? count_keys_below_avx2
+                                            : count_keys_below_sse2;
+#endif
+  __atomic_store_n(&count_keys_below, function, __ATOMIC_RELAXED);
+  return function(keys, num_keys, key);
+}
+
+/* internal_node_find_child() for an index tree's 64-bit keys */
+uint32_t index_internal_node_find_child(void* node, uint64_t key) {
+  uint64_t* keys = index_internal_node_keys(node);
+  uint32_t min_index = 0;
+  uint32_t max_index = *internal_node_num_keys(node);
+  while (max_index != min_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (keys[index] >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+uint32_t internal_node_find_child(Table* table, void* node, uint64_t key) {
+  /*
+  Return the index of the child which should contain the given key:
+  the first whose key is >= key, or the right child if there is none.
+  Bisect down to one block of keys, then count the keys in it that
+  are smaller, which is branch-free and vectorized.
+  */
+
+  if (table->is_index) {
+    return index_internal_node_find_child(node, key);
+  }
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (key > UINT32_MAX) {
+    /* Past every key a table can hold */
+    return num_keys;
+  }
+  uint32_t* keys = internal_node_keys(node);
+
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys; /* there is one more child than key */
+
+  while (max_index - min_index > INTERNAL_NODE_SEARCH_BLOCK) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (keys[index] >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+
+  CountKeysFunction count =
+      __atomic_load_n(&count_keys_below, __ATOMIC_RELAXED);
+  return min_index + count(keys + min_index, max_index - min_index, key);
+}
+
+/*
+The caller holds a shared latch on the node. The child is latched
+before the node is let go, so the writer cannot change the link in
+between.
+*/
+void internal_node_find(Cursor* cursor, Table* table, uint32_t page_num,
+                        void* node, uint64_t key) {
+  uint32_t child_index = internal_node_find_child(table, node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+  void* child = latch_page(table->pager, child_num, LATCH_SHARED);
+  unlatch_page(table->pager, page_num);
+
+  switch (get_node_type(child)) {
+    case NODE_LEAF:
+      leaf_node_find(cursor, table, child_num, child, key);
+      break;
+    case NODE_INTERNAL:
+      internal_node_find(cursor, table, child_num, child, key);
+      break;
+  }
+}
+
+uint32_t table_root(Table* table) {
+  return __atomic_load_n(&table->root_page_num, __ATOMIC_ACQUIRE);
+}
+
+/*
+Point the cursor at the position of the given key.
+If the key is not present, at the position
+where it should be inserted
+*/
+void table_find(Cursor* cursor, Table* table, uint64_t key) {
+  pager_advise(table->pager, MADV_RANDOM);
+  uint32_t root_page_num;
+  void* root_node;
+  while (true) {
+    root_page_num = table_root(table);
+    root_node = latch_page(table->pager, root_page_num, LATCH_SHARED);
+    if (root_page_num == table_root(table)) {
+      break;
+    }
+    /* A delete moved the root down a level while we waited */
+    unlatch_page(table->pager, root_page_num);
+  }
+
+  if (get_node_type(root_node) == NODE_LEAF) {
+    leaf_node_find(cursor, table, root_page_num, root_node, key);
+  } else {
+    internal_node_find(cursor, table, root_page_num, root_node, key);
+  }
+}
+
+/*
+Latch the page exclusively for the writer, unless it already holds
+it. The latch is kept until table_unlatch_all().
+*/
+void table_latch_page(Table* table, uint32_t page_num) {
+  for (uint32_t i = 0; i < table->num_latched_pages; i++) {
+    if (table->latched_pages[i] == page_num) {
+      return;
+    }
+  }
+  if (table->num_latched_pages == TABLE_MAX_LATCHED_PAGES) {
+    printf("Writer holds too many latches.\n");
+    exit(EXIT_FAILURE);
+  }
+  latch_page(table->pager, page_num, LATCH_EXCLUSIVE);
+  table->latched_pages[table->num_latched_pages++] = page_num;
+}
+
+/* Release every latch the writer holds except keep_page_num's */
+void table_unlatch_all_but(Table* table, uint32_t keep_page_num) {
+  uint32_t num_kept = 0;
+  for (uint32_t i = 0; i < table->num_latched_pages; i++) {
+    uint32_t page_num = table->latched_pages[i];
+    if (page_num == keep_page_num) {
+      table->latched_pages[num_kept++] = page_num;
+    } else {
+      unlatch_page(table->pager, page_num);
+    }
+  }
+  table->num_latched_pages = num_kept;
+}
+
+void table_unlatch_all(Table* table) {
+  table_unlatch_all_but(table, INVALID_PAGE_NUM);
+}
+
+/*
+Whether an insert below the node can reach its parent. It cannot if
+the node has room for one more cell or child.
+*/
+bool node_is_full(Table* table, void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_free_space(node) < LEAF_NODE_MAX_CELL_SIZE;
+  }
+  return *internal_node_num_keys(node) >= internal_node_max_cells(table);
+}
+
+/*
+An insert of a key past the last one in the tree, while the rightmost
+leaf has room, goes straight to that leaf: nothing above it changes,
+so nothing above it is latched. table->append_leaf remembers the leaf
+from the last insert that reached it, and is forgotten by anything
+that may free or move it. Returns false, holding nothing, if the
+insert has to come down from the root.
+*/
+bool table_find_append(Cursor* cursor, Table* table, uint64_t key) {
+  uint32_t page_num = table->append_leaf;
+  if (page_num == INVALID_PAGE_NUM) {
+    return false;
+  }
+  Pager* pager = table->pager;
+  table_latch_page(table, page_num);
+  void* node = get_page(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (node_is_full(table, node) ||
+      (num_cells > 0 &&
+       leaf_node_cell_key(table, node, num_cells - 1) >= key)) {
+    unpin_page(pager, page_num, false);
+    table_unlatch_all(table);
+    return false;
+  }
+  leaf_node_find(cursor, table, page_num, node, key);
+  cursor->mode = CURSOR_WRITER;
+  return true;
+}
+
+/*
+The writer's way down. Every node on the path is latched exclusively,
+top-down like a reader's. During an insert, the latches above a node
+are let go once the node is not full, since a split cannot reach past
+it. A delete can change separator keys all the way up, so it keeps
+the whole path. Either way the path stays latched until
+table_unlatch_all(). The cursor holds a pin of its own.
+*/
+void table_find_for_write(Cursor* cursor, Table* table, uint64_t key,
+                          bool is_insert) {
+  if (is_insert && table_find_append(cursor, table, key)) {
+    return;
+  }
+  Pager* pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  table_latch_page(table, page_num);
+  void* node = get_page(pager, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(table, node, key);
+    uint32_t child_page_num = *internal_node_child(node, child_index);
+    unpin_page(pager, page_num, false);
+
+    table_latch_page(table, child_page_num);
+    node = get_page(pager, child_page_num);
+    page_num = child_page_num;
+    if (is_insert && !node_is_full(table, node)) {
+      table_unlatch_all_but(table, page_num);
+    }
+  }
+
+  if (is_insert && *leaf_node_next_leaf(node) == 0) {
+    table->append_leaf = page_num;
+  }
+  leaf_node_find(cursor, table, page_num, node, key);
+  cursor->mode = CURSOR_WRITER;
+}
+
+void table_start(Cursor* cursor, Table* table) {
+  table_find(cursor, table, 0);
+  pager_advise(table->pager, MADV_SEQUENTIAL);
+  cursor->end_of_table = (*leaf_node_num_cells(cursor->node) == 0);
+}
+
+/*
+Move the cursor to the first row of the leaf after its own, where
+it will find resume_key or the first key past it. Readers only wait
+for latches on the way down, so the latch of the next leaf is only
+tried. If the writer holds it, perhaps to merge the cursor's leaf with
+it, the cursor lets go of its leaf and comes down from the root again.
+*/
+void cursor_next_leaf(Cursor* cursor, uint32_t next_page_num,
+                      uint64_t resume_key) {
+  Pager* pager = cursor->table->pager;
+  while (true) {
+    if (next_page_num == 0) {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+      return;
+    }
+    if (cursor->mode == CURSOR_SNAPSHOT) {
+      /* Nobody changes a snapshot, so the link can just be followed */
+      pager_read_snapshot(pager, cursor->snapshot, next_page_num,
+                          cursor->node);
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+      return;
+    }
+    void* next = try_latch_page(pager, next_page_num, LATCH_SHARED);
+    if (next != NULL) {
+      unlatch_page(pager, cursor->page_num);
+      cursor->page_num = next_page_num;
+      cursor->node = next;
+      cursor->cell_num = 0;
+      return;
+    }
+
+    unlatch_page(pager, cursor->page_num);
+    Cursor found;
+    table_find(&found, cursor->table, resume_key);
+    cursor->page_num = found.page_num;
+    cursor->node = found.node;
+    cursor->cell_num = found.cell_num;
+
+    next_page_num = *leaf_node_next_leaf(cursor->node);
+    if (cursor->cell_num < *leaf_node_num_cells(cursor->node)) {
+      return;
+    }
+  }
+}
+
+/*
+Point the cursor at the first row whose key is >= key. Unlike
+table_find(), the cursor is never left one past the end of a leaf
+that has a right sibling.
+*/
+void table_seek(Cursor* cursor, Table* table, uint64_t key) {
+  table_find(cursor, table, key);
+  void* node = cursor->node;
+  if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+    cursor_next_leaf(cursor, *leaf_node_next_leaf(node), key);
+  }
+}
+
+/*
+Like table_seek(), but the cursor reads the table as it is now, in
+its own copy of each page, for as long as it stays open. It never
+waits for the writer, and the writer never waits for it. The root is
+looked up in the header page, which is read at the snapshot as well.
+Returns false, leaving the cursor closed, if the tree had no root yet
+at the snapshot, which only happens to an index created since.
+*/
+bool table_seek_snapshot(Cursor* cursor, Table* table, uint64_t key) {
+  Pager* pager = table->pager;
+  Snapshot snapshot = pager_snapshot_begin(pager);
+  void* node = cursor->page_copy;
+  pager_read_snapshot(pager, snapshot, HEADER_PAGE_NUM, node);
+  uint32_t page_num = *table_header_root(table, node);
+  if (page_num == 0) {
+    pager_snapshot_end(pager, snapshot);
+    return false;
+  }
+  pager_read_snapshot(pager, snapshot, page_num, node);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(table, node, key);
+    page_num = *internal_node_child(node, child_index);
+    pager_read_snapshot(pager, snapshot, page_num, node);
+  }
+
+  leaf_node_find(cursor, table, page_num, node, key);
+  cursor->mode = CURSOR_SNAPSHOT;
+  cursor->snapshot = snapshot;
+  if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+    cursor_next_leaf(cursor, *leaf_node_next_leaf(node), key);
+  }
+  return true;
+}
+
+/* The number of levels of the tree as of the last commit, 0 if none */
+uint32_t table_height(Table* table) {
+  Pager* pager = table->pager;
+  Snapshot snapshot = pager_snapshot_begin(pager);
+  uint8_t node[PAGE_SIZE];
+  pager_read_snapshot(pager, snapshot, HEADER_PAGE_NUM, node);
+  uint32_t page_num = *table_header_root(table, (FileHeader*)node);
+  uint32_t height = 0;
+  while (page_num != 0) {
+    pager_read_snapshot(pager, snapshot, page_num, node);
+    height++;
+    page_num = get_node_type(node) == NODE_INTERNAL
+                   ? *internal_node_child(node, 0)
+                   : 0;
+  }
+  pager_snapshot_end(pager, snapshot);
+  return height;
+}
+
+/* The header field that records the tree's root */
+uint32_t* table_header_root(Table* table, FileHeader* header) {
+  if (table->is_index) {
+    return &header->index_root_page_nums[table->indexed_column];
+  }
+  return &header->root_page_num;
+}
+
+/*
+The root's page number lives in the file header, so a root that
+moves (bulk load, vacuum) is found again on the next open.
+*/
+void table_set_root(Table* table, uint32_t root_page_num) {
+  __atomic_store_n(&table->root_page_num, root_page_num, __ATOMIC_RELEASE);
+  FileHeader* header = get_page(table->pager, HEADER_PAGE_NUM);
+  *table_header_root(table, header) = root_page_num;
+  unpin_page(table->pager, HEADER_PAGE_NUM, true);
+}
+
+/* Start the tree out as a single empty leaf */
+void table_create_root(Table* table) {
+  uint32_t root_page_num = get_unused_page_num(table->pager);
+  void* root_node = get_page(table->pager, root_page_num);
+  initialize_leaf_node(root_node);
+  set_node_root(root_node, true);
+  unpin_page(table->pager, root_page_num, true);
+  table_set_root(table, root_page_num);
+}
+
+bool table_is_empty(Table* table) {
+  void* root = get_page(table->pager, table->root_page_num);
+  bool is_empty =
+      get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+  unpin_page(table->pager, table->root_page_num, false);
+  return is_empty;
+}
+
+/*
+The returned pointer stays valid until the cursor moves
+to another leaf or is closed, since the cursor holds on to its leaf.
+*/
+void* cursor_value(Cursor* cursor) {
+  return leaf_node_value(cursor->node, cursor->cell_num);
+}
+
+uint64_t cursor_key(Cursor* cursor) {
+  return leaf_node_cell_key(cursor->table, cursor->node, cursor->cell_num);
+}
+
+/*
+A range scan ends at the first key past last_key, so it never reads
+further than one cell beyond the range.
+*/
+void cursor_set_last_key(Cursor* cursor, uint64_t last_key) {
+  cursor->last_key = last_key;
+  if (!cursor->end_of_table && cursor_key(cursor) > last_key) {
+    cursor->end_of_table = true;
+  }
+}
+
+/*
+The leaf after node, or 0 once node already holds keys past last_key.
+*/
+uint32_t leaf_node_next_page(void* node, uint64_t last_key) {
+  if (get_node_type(node) != NODE_LEAF) {
+    return 0;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells > 0 && *leaf_node_key(node, num_cells - 1) >= last_key) {
+    return 0;
+  }
+  return *leaf_node_next_leaf(node);
+}
+
+/* leaf_node_next_page() for an index tree's leaves */
+uint32_t index_leaf_node_next_page(void* node, uint64_t last_key) {
+  if (get_node_type(node) != NODE_LEAF) {
+    return 0;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells > 0 &&
+      index_entry_key(leaf_node_cell(node, num_cells - 1)) >= last_key) {
+    return 0;
+  }
+  return *leaf_node_next_leaf(node);
+}
+
+/*
+Called each time a scan moves to the next leaf. Point lookups and
+short ranges never get this far. Once a scan has crossed
+READAHEAD_TRIGGER_LEAVES leaves, the pager starts reading ahead. Every
+time the scan has used up half of its window, the window is refilled
+and doubled, up to the pager's limit, so a long scan soon keeps a
+deep queue of reads in flight.
+*/
+#define READAHEAD_TRIGGER_LEAVES 8
+#define READAHEAD_MIN_DEPTH 4
+
+void cursor_readahead(Cursor* cursor) {
+  uint32_t max_depth = cursor->table->pager->readahead.max_pages;
+  cursor->leaves_visited++;
+  if (cursor->readahead_ahead > 0) {
+    cursor->readahead_ahead--;
+  }
+  if (max_depth == 0 || cursor->leaves_visited < READAHEAD_TRIGGER_LEAVES ||
+      cursor->readahead_ahead > cursor->readahead_depth / 2) {
+    return;
+  }
+
+  if (cursor->readahead_depth == 0) {
+    cursor->readahead_depth = READAHEAD_MIN_DEPTH;
+  } else {
+    cursor->readahead_depth *= 2;
+  }
+  if (cursor->readahead_depth > max_depth) {
+    cursor->readahead_depth = max_depth;
+  }
+  NextPageFunction next_page = cursor->table->is_index
+                                   ? index_leaf_node_next_page
+                                   : leaf_node_next_page;
+  pager_readahead(cursor->table->pager, cursor->page_num,
+                  cursor->readahead_depth, next_page, cursor->last_key);
+  cursor->readahead_ahead = cursor->readahead_depth;
+}
+
+void cursor_advance(Cursor* cursor) {
+  void* node = cursor->node;
+  cursor->cell_num += 1;
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (cursor->cell_num >= num_cells) {
+    /* Advance to next leaf node */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    uint64_t last_key = leaf_node_cell_key(cursor->table, node, num_cells - 1);
+    if (last_key == table_max_key(cursor->table)) {
+      cursor->end_of_table = true;
+    } else {
+      cursor_next_leaf(cursor, next_page_num, last_key + 1);
+    }
+    if (!cursor->end_of_table) {
+      cursor_readahead(cursor);
+    }
+  }
+
+  if (!cursor->end_of_table &&
+      cursor->last_key != table_max_key(cursor->table) &&
+      cursor_key(cursor) > cursor->last_key) {
+    cursor->end_of_table = true;
+  }
+}
+
+void cursor_close(Cursor* cursor) {
+  Pager* pager = cursor->table->pager;
+  switch (cursor->mode) {
+    case CURSOR_WRITER:
+      unpin_page(pager, cursor->page_num, false);
+      break;
+    case CURSOR_LATCHED:
+      unlatch_page(pager, cursor->page_num);
+      break;
+    case CURSOR_SNAPSHOT:
+      pager_snapshot_end(pager, cursor->snapshot);
+      break;
+  }
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+  /*
+  Handle splitting the root.
+  Old root copied to new page, becomes left child.
+  Address of right child passed in.
+  Re-initialize root page to contain the new root node.
+  New root node points to two children.
+  */
+
+  void* root = get_page(table->pager, table->root_page_num);
+  void* right_child = get_page(table->pager, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void* left_child = get_page(table->pager, left_child_page_num);
+
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint64_t left_child_max_key = get_node_max_key(table, left_child);
+  internal_node_set_key(table, root, 0, left_child_max_key);
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+
+  /* Children of an internal left child moved pages along with it */
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++) {
+      uint32_t child_page_num = *internal_node_child(left_child, i);
+      void* child = get_page(table->pager, child_page_num);
+      *node_parent(child) = left_child_page_num;
+      unpin_page(table->pager, child_page_num, true);
+    }
+  }
+
+  unpin_page(table->pager, table->root_page_num, true);
+  unpin_page(table->pager, right_child_page_num, true);
+  unpin_page(table->pager, left_child_page_num, true);
+}
+
+void internal_node_split_and_insert(Table* table, uint32_t old_page_num,
+                                    uint32_t child_page_num,
+                                    uint64_t child_max_key, bool append);
+
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num, bool append) {
+  /*
+  Add a new child/key pair to parent that corresponds to child. append
+  is set when the child was split off the rightmost leaf by an append,
+  which puts parent on the right edge of the tree.
+  */
+
+  Pager* pager = table->pager;
+  void* child = get_page(pager, child_page_num);
+  uint64_t child_max_key = get_node_max_key(table, child);
+  unpin_page(pager, child_page_num, false);
+
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= internal_node_max_cells(table)) {
+    unpin_page(pager, parent_page_num, false);
+    internal_node_split_and_insert(table, parent_page_num, child_page_num,
+                                   child_max_key, append);
+    return;
+  }
+
+  uint32_t index = internal_node_find_child(table, parent, child_max_key);
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  void* right_child = get_page(pager, right_child_page_num);
+  uint64_t right_child_max_key = get_node_max_key(table, right_child);
+  unpin_page(pager, right_child_page_num, false);
+
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  if (child_max_key > right_child_max_key) {
+    /* Replace right child */
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    internal_node_set_key(table, parent, original_num_keys,
+                          right_child_max_key);
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    /* Make room for the new cell */
+    internal_node_move_cells(table, parent, index + 1, parent, index,
+                             original_num_keys - index);
+    *internal_node_child(parent, index) = child_page_num;
+    internal_node_set_key(table, parent, index, child_max_key);
+  }
+
+  unpin_page(pager, parent_page_num, true);
+}
+
+void update_internal_node_key(Table* table, void* node, uint64_t old_key,
+                              uint64_t new_key) {
+  uint32_t old_child_index = internal_node_find_child(table, node, old_key);
+  if (old_child_index == *internal_node_num_keys(node)) {
+    /* The right child has no key of its own */
+    return;
+  }
+  internal_node_set_key(table, node, old_child_index, new_key);
+}
+
+void internal_node_set_children(Table* table, void* node, uint32_t* children,
+                                uint64_t* max_keys, uint32_t num_children) {
+  *internal_node_num_keys(node) = num_children - 1;
+  for (uint32_t i = 0; i < num_children - 1; i++) {
+    *internal_node_child(node, i) = children[i];
+    internal_node_set_key(table, node, i, max_keys[i]);
+  }
+  *internal_node_right_child(node) = children[num_children - 1];
+}
+
+void internal_node_split_and_insert(Table* table, uint32_t old_page_num,
+                                    uint32_t child_page_num,
+                                    uint64_t child_max_key, bool append) {
+  /*
+  Lay out every child of the full node plus the new child in key
+  order. The lower half stays in the old node, the upper half moves
+  to a new sibling, and the new sibling is inserted into the parent,
+  which may split in turn. Splitting the root grows the tree by one level.
+  */
+
+  Pager* pager = table->pager;
+  stats_add(pager->counters, STAT_INTERNAL_SPLITS, 1);
+  uint32_t num_children = internal_node_max_cells(table) + 2;
+  uint32_t children[num_children];
+  uint64_t max_keys[num_children];
+
+  void* old_node = get_page(pager, old_page_num);
+  uint32_t num_keys = *internal_node_num_keys(old_node);
+  uint64_t old_max = get_node_max_key(table, old_node);
+
+  uint32_t j = 0;
+  bool child_placed = false;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    uint64_t max_key =
+        i < num_keys ? internal_node_key(table, old_node, i) : old_max;
+    if (!child_placed && child_max_key < max_key) {
+      children[j] = child_page_num;
+      max_keys[j] = child_max_key;
+      j++;
+      child_placed = true;
+    }
+    children[j] = *internal_node_child(old_node, i);
+    max_keys[j] = max_key;
+    j++;
+  }
+  if (!child_placed) {
+    children[j] = child_page_num;
+    max_keys[j] = child_max_key;
+  }
+
+  /*
+  On the right edge of the tree, below an append, the new child comes
+  last. As with the leaf, the old node is left nearly full: the new
+  node starts with its last child and the new one. Anywhere else a
+  child past the last one is only a split of the node's last child,
+  and appends will not follow to fill the node up again.
+  */
+  uint32_t left_count =
+      append && !child_placed ? num_children - 2 : num_children / 2;
+  uint32_t right_count = num_children - left_count;
+
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  initialize_internal_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+
+  internal_node_set_children(table, old_node, children, max_keys, left_count);
+  internal_node_set_children(table, new_node, children + left_count,
+                             max_keys + left_count, right_count);
+
+  bool old_node_was_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  uint64_t new_max = max_keys[left_count - 1];
+  unpin_page(pager, old_page_num, true);
+  unpin_page(pager, new_page_num, true);
+
+  /* Children that moved to the new node need their parent pointers fixed */
+  for (uint32_t i = left_count; i < num_children; i++) {
+    void* child = get_page(pager, children[i]);
+    *node_parent(child) = new_page_num;
+    unpin_page(pager, children[i], true);
+  }
+
+  if (old_node_was_root) {
+    create_new_root(table, new_page_num);
+  } else {
+    void* parent = get_page(pager, parent_page_num);
+    update_internal_node_key(table, parent, old_max, new_max);
+    unpin_page(pager, parent_page_num, true);
+
+    internal_node_insert(table, parent_page_num, new_page_num, append);
+  }
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint64_t key,
+                                const RowFields* value) {
+  /*
+  Create a new node and move half the cells over.
+  Insert the new value in one of the two nodes.
+  Update parent or create a new parent.
+  */
+
+  Table* table = cursor->table;
+  Pager* pager = table->pager;
+  stats_add(pager->counters, STAT_LEAF_SPLITS, 1);
+  void* old_node = get_page(pager, cursor->page_num);
+  uint64_t old_max = get_node_max_key(table, old_node);
+  bool was_rightmost = *leaf_node_next_leaf(old_node) == 0;
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+  All existing cells plus the new one should be divided evenly, by
+  bytes, between old (left) and new (right) nodes. The old cells are
+  copied out first, since the old node is rebuilt in place.
+  */
+  uint8_t old_copy[PAGE_SIZE];
+  memcpy(old_copy, old_node, PAGE_SIZE);
+  uint8_t new_cell[ROW_MAX_SIZE];
+  serialize_row_fields(value, new_cell);
+
+  uint32_t num_cells = *leaf_node_num_cells(old_copy);
+  void* cells[LEAF_NODE_MAX_CELLS + 1];
+  for (uint32_t i = 0, j = 0; i <= num_cells; i++) {
+    if (i == cursor->cell_num) {
+      cells[i] = new_cell;
+    } else {
+      cells[i] = leaf_node_cell(old_copy, j++);
+    }
+  }
+  leaf_node_clear(old_node);
+  bool append = was_rightmost && cursor->cell_num == num_cells;
+  if (append) {
+    /*
+    An append. More are likely to follow, so the old node is left full
+    and the new one starts out with only the new row, rather than
+    leaving both half empty for good.
+    */
+    for (uint32_t i = 0; i < num_cells; i++) {
+      leaf_node_append_cell(old_node, cells[i]);
+    }
+    leaf_node_append_cell(new_node, new_cell);
+  } else {
+    leaf_node_distribute(cells, num_cells + 1, old_node, new_node);
+  }
+  if (was_rightmost) {
+    table->append_leaf = new_page_num;
+  }
+
+  bool old_node_was_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  uint64_t new_max = get_node_max_key(table, old_node);
+  unpin_page(pager, cursor->page_num, true);
+  unpin_page(pager, new_page_num, true);
+
+  if (old_node_was_root) {
+    return create_new_root(table, new_page_num);
+  } else {
+    void* parent = get_page(pager, parent_page_num);
+    update_internal_node_key(table, parent, old_max, new_max);
+    unpin_page(pager, parent_page_num, true);
+
+    internal_node_insert(table, parent_page_num, new_page_num, append);
+    return;
+  }
+}
+
+void leaf_node_insert(Cursor* cursor, uint64_t key, const RowFields* value) {
+  void* node = get_page(cursor->table->pager, cursor->page_num);
+
+  uint32_t size = row_size(value);
+  if (leaf_node_free_space(node) < size + LEAF_NODE_SLOT_SIZE) {
+    // Node full
+    unpin_page(cursor->table->pager, cursor->page_num, false);
+    leaf_node_split_and_insert(cursor, key, value);
+    return;
+  }
+
+  serialize_row_fields(value,
+                       leaf_node_insert_cell(node, cursor->cell_num, size));
+  unpin_page(cursor->table->pager, cursor->page_num, true);
+}
+
+/*
+ * Bulk loading builds the tree bottom-up from rows sorted by id.
+ * Leaves are filled one after another, and each internal level keeps
+ * one open node on the right edge of the tree that collects finished
+ * children. A node is only closed once its successor is needed, so the
+ * top level never ends up with a single child.
+ */
+void bulk_load_init(BulkLoader* loader, Table* table, uint32_t fill_factor) {
+  loader->table = table;
+  table->append_leaf = INVALID_PAGE_NUM;
+  loader->leaf_fill = LEAF_NODE_SPACE_FOR_CELLS * fill_factor / 100;
+  loader->internal_fill =
+      (internal_node_max_cells(table) + 1) * fill_factor / 100;
+  if (loader->internal_fill < 2) {
+    loader->internal_fill = 2;
+  }
+  loader->leaf_page_num = INVALID_PAGE_NUM;
+  loader->last_key = 0;
+  loader->num_rows = 0;
+  loader->num_levels = 0;
+}
+
+void bulk_load_add_child(BulkLoader* loader, uint32_t level,
+                         uint32_t child_page_num, uint64_t child_max_key) {
+  Pager* pager = loader->table->pager;
+  BulkLoadLevel* open = &(loader->levels[level]);
+
+  if (level == loader->num_levels ||
+      open->num_children == loader->internal_fill) {
+    if (level < loader->num_levels) {
+      /* The open node is full. Hand it to the level above. */
+      bulk_load_add_child(loader, level + 1, open->page_num,
+                          open->right_child_max_key);
+    } else if (loader->num_levels == BULK_LOAD_MAX_LEVELS) {
+      printf("Bulk load tree is too deep.\n");
+      exit(EXIT_FAILURE);
+    } else {
+      loader->num_levels++;
+    }
+
+    open->page_num = get_unused_page_num(pager);
+    open->num_children = 0;
+    void* node = get_page(pager, open->page_num);
+    initialize_internal_node(node);
+    unpin_page(pager, open->page_num, true);
+  }
+
+  void* node = get_page(pager, open->page_num);
+  if (open->num_children > 0) {
+    uint32_t right_child_page_num = *internal_node_right_child(node);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    *internal_node_num_keys(node) = num_keys + 1;
+    *internal_node_child(node, num_keys) = right_child_page_num;
+    internal_node_set_key(loader->table, node, num_keys,
+                          open->right_child_max_key);
+  }
+  *internal_node_right_child(node) = child_page_num;
+  open->right_child_max_key = child_max_key;
+  open->num_children++;
+  unpin_page(pager, open->page_num, true);
+
+  void* child = get_page(pager, child_page_num);
+  *node_parent(child) = open->page_num;
+  unpin_page(pager, child_page_num, true);
+}
+
+void bulk_load_append(BulkLoader* loader, const Row* row) {
+  RowFields fields;
+  row_fields(row, &fields);
+  bulk_load_append_fields(loader, &fields);
+}
+
+/* Rows, or index entries, must come in key order */
+void bulk_load_append_fields(BulkLoader* loader, const RowFields* fields) {
+  Pager* pager = loader->table->pager;
+  void* leaf;
+  uint32_t size = row_size(fields);
+
+  if (loader->leaf_page_num == INVALID_PAGE_NUM) {
+    loader->leaf_page_num = get_unused_page_num(pager);
+    leaf = get_page(pager, loader->leaf_page_num);
+    initialize_leaf_node(leaf);
+  } else {
+    leaf = get_page(pager, loader->leaf_page_num);
+    /* Every leaf takes at least one row, however low the fill factor */
+    if (*leaf_node_num_cells(leaf) > 0 &&
+        leaf_node_used_space(leaf) + size + LEAF_NODE_SLOT_SIZE >
+            loader->leaf_fill) {
+      uint32_t full_page_num = loader->leaf_page_num;
+      loader->leaf_page_num = get_unused_page_num(pager);
+      void* next_leaf = get_page(pager, loader->leaf_page_num);
+      initialize_leaf_node(next_leaf);
+      *leaf_node_next_leaf(leaf) = loader->leaf_page_num;
+      unpin_page(pager, full_page_num, true);
+
+      bulk_load_add_child(loader, 0, full_page_num, loader->last_key);
+      leaf = next_leaf;
+    }
+  }
+
+  uint32_t cell_num = *leaf_node_num_cells(leaf);
+  serialize_row_fields(fields, leaf_node_insert_cell(leaf, cell_num, size));
+  loader->last_key = leaf_node_cell_key(loader->table, leaf, cell_num);
+  unpin_page(pager, loader->leaf_page_num, true);
+
+  loader->num_rows++;
+}
+
+void bulk_load_finish(BulkLoader* loader) {
+  /*
+  Close the open node of every level bottom-up. Whatever is left
+  on top becomes the root.
+  */
+  Table* table = loader->table;
+  Pager* pager = table->pager;
+  if (loader->leaf_page_num == INVALID_PAGE_NUM) {
+    return;
+  }
+
+  uint32_t top_page_num = loader->leaf_page_num;
+  uint64_t top_max_key = loader->last_key;
+  for (uint32_t level = 0; level < loader->num_levels; level++) {
+    bulk_load_add_child(loader, level, top_page_num, top_max_key);
+    top_page_num = loader->levels[level].page_num;
+    top_max_key = loader->levels[level].right_child_max_key;
+  }
+
+  /* The top node becomes the root, and the empty old root is freed */
+  uint32_t old_root_page_num = table->root_page_num;
+  void* top = get_page(pager, top_page_num);
+  set_node_root(top, true);
+  unpin_page(pager, top_page_num, true);
+  table_set_root(table, top_page_num);
+  pager_free_page(pager, old_root_page_num);
+}
+
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+  printf("Page %d is not a child of its parent\n", child_page_num);
+  exit(EXIT_FAILURE);
+}
+
+/*
+Return the leaf whose next_leaf points at the given leaf, or
+INVALID_PAGE_NUM for the leftmost leaf. Climb until we come from a
+child that has a left neighbour, then descend along the right edge
+of that neighbour.
+*/
+uint32_t leaf_node_predecessor(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  uint32_t child_page_num = page_num;
+  while (child_page_num != table->root_page_num) {
+    void* child = get_page(pager, child_page_num);
+    uint32_t parent_page_num = *node_parent(child);
+    unpin_page(pager, child_page_num, false);
+
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_child_index(parent, child_page_num);
+    if (index > 0) {
+      uint32_t left_page_num = *internal_node_child(parent, index - 1);
+      unpin_page(pager, parent_page_num, false);
+
+      while (true) {
+        void* node = get_page(pager, left_page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+          unpin_page(pager, left_page_num, false);
+          return left_page_num;
+        }
+        uint32_t right_child_page_num = *internal_node_right_child(node);
+        unpin_page(pager, left_page_num, false);
+        left_page_num = right_child_page_num;
+      }
+    }
+    unpin_page(pager, parent_page_num, false);
+    child_page_num = parent_page_num;
+  }
+  return INVALID_PAGE_NUM;
+}
+
+/*
+Move a tree node to another page and repoint everything that refers
+to it: the parent's child pointer (or the file header for the root),
+the parent pointers of its children, and the next_leaf link of the
+leaf before it.
+*/
+void table_move_page(Table* table, uint32_t from_page_num,
+                     uint32_t to_page_num) {
+  Pager* pager = table->pager;
+
+  void* from = get_page(pager, from_page_num);
+  bool is_leaf = get_node_type(from) == NODE_LEAF;
+  unpin_page(pager, from_page_num, false);
+  uint32_t predecessor_page_num = INVALID_PAGE_NUM;
+  if (is_leaf) {
+    predecessor_page_num = leaf_node_predecessor(table, from_page_num);
+  }
+
+  from = get_page(pager, from_page_num);
+  void* to = get_page(pager, to_page_num);
+  memcpy(to, from, PAGE_SIZE);
+  unpin_page(pager, from_page_num, false);
+
+  if (from_page_num == table->root_page_num) {
+    table_set_root(table, to_page_num);
+  } else {
+    uint32_t parent_page_num = *node_parent(to);
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_child_index(parent, from_page_num);
+    *internal_node_child(parent, index) = to_page_num;
+    unpin_page(pager, parent_page_num, true);
+  }
+
+  if (is_leaf) {
+    if (predecessor_page_num != INVALID_PAGE_NUM) {
+      void* predecessor = get_page(pager, predecessor_page_num);
+      *leaf_node_next_leaf(predecessor) = to_page_num;
+      unpin_page(pager, predecessor_page_num, true);
+    }
+  } else {
+    for (uint32_t i = 0; i <= *internal_node_num_keys(to); i++) {
+      uint32_t child_page_num = *internal_node_child(to, i);
+      void* child = get_page(pager, child_page_num);
+      *node_parent(child) = to_page_num;
+      unpin_page(pager, child_page_num, true);
+    }
+  }
+  unpin_page(pager, to_page_num, true);
+}
+
+/* The table or index whose tree the page is part of */
+Table* table_tree_of_page(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  while (true) {
+    void* node = get_page(pager, page_num);
+    bool is_root = is_node_root(node);
+    uint32_t parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num, false);
+    if (is_root) {
+      break;
+    }
+    page_num = parent_page_num;
+  }
+
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i]->root_page_num == page_num) {
+      return table->indexes[i];
+    }
+  }
+  return table;
+}
+
+uint32_t table_vacuum(Table* table, uint32_t max_pages) {
+  /*
+  Cut the last n pages off the file, where n is the number of free
+  pages (at most max_pages). Every page in that tail that is still in
+  use is moved into one of the free pages below it, lowest first.
+  Free pages that are neither cut off nor used go back on the freelist.
+  */
+  Pager* pager = table->pager;
+  table->append_leaf = INVALID_PAGE_NUM;
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    table->indexes[i]->append_leaf = INVALID_PAGE_NUM;
+  }
+  uint32_t num_free_pages;
+  uint32_t* free_pages = pager_take_free_pages(pager, &num_free_pages);
+
+  uint32_t num_released = num_free_pages < max_pages ? num_free_pages
+                                                     : max_pages;
+  uint32_t new_num_pages = pager->num_pages - num_released;
+
+  uint32_t next_target = 0;  // index into free_pages
+  uint32_t next_tail_free = 0;
+  while (next_tail_free < num_free_pages &&
+         free_pages[next_tail_free] < new_num_pages) {
+    next_tail_free++;
+  }
+  for (uint32_t page_num = new_num_pages; page_num < pager->num_pages;
+       page_num++) {
+    if (next_tail_free < num_free_pages &&
+        free_pages[next_tail_free] == page_num) {
+      next_tail_free++;
+      continue;
+    }
+    table_move_page(table_tree_of_page(table, page_num), page_num,
+                    free_pages[next_target]);
+    next_target++;
+  }
+
+  for (uint32_t i = next_target;
+       i < num_free_pages && free_pages[i] < new_num_pages; i++) {
+    pager_free_page(pager, free_pages[i]);
+  }
+  free(free_pages);
+
+  pager_truncate(pager, new_num_pages);
+  return num_released;
+}
+
+/*
+ * Deletion. An underfull node borrows one entry from a sibling under
+ * the same parent if the sibling can spare it, and is merged with that
+ * sibling otherwise. A merge takes a child away from the parent, which
+ * may leave the parent underfull in turn. A root left with a single
+ * child is replaced by that child, so the tree shrinks by one level.
+ */
+
+/*
+Make the key that stands for this node in its ancestors match the
+node's current max key. Only the nearest ancestor in which the node
+is not on the right edge keeps such a key.
+*/
+void update_node_max_key(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  uint64_t max_key = get_node_max_key(table, node);
+  unpin_page(pager, page_num, false);
+
+  uint32_t child_page_num = page_num;
+  while (child_page_num != table->root_page_num) {
+    void* child = get_page(pager, child_page_num);
+    uint32_t parent_page_num = *node_parent(child);
+    unpin_page(pager, child_page_num, false);
+
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_child_index(parent, child_page_num);
+    if (index < *internal_node_num_keys(parent)) {
+      internal_node_set_key(table, parent, index, max_key);
+      unpin_page(pager, parent_page_num, true);
+      return;
+    }
+    unpin_page(pager, parent_page_num, false);
+    child_page_num = parent_page_num;
+  }
+}
+
+void internal_node_remove_child(Table* table, void* node, uint32_t index) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (index == num_keys) {
+    /* The child to the left takes over as the right child */
+    *internal_node_right_child(node) = *internal_node_child(node, index - 1);
+  } else {
+    internal_node_move_cells(table, node, index, node, index + 1,
+                             num_keys - index - 1);
+  }
+  *internal_node_num_keys(node) = num_keys - 1;
+}
+
+/*
+Find the siblings of a node under its parent. A missing sibling is
+INVALID_PAGE_NUM.
+*/
+uint32_t node_siblings(Table* table, uint32_t page_num,
+                       uint32_t* left_page_num, uint32_t* right_page_num) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  uint32_t parent_page_num = *node_parent(node);
+  unpin_page(pager, page_num, false);
+
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t index = internal_node_child_index(parent, page_num);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  *left_page_num =
+      index > 0 ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+  *right_page_num = index < num_keys ? *internal_node_child(parent, index + 1)
+                                     : INVALID_PAGE_NUM;
+  unpin_page(pager, parent_page_num, false);
+  return parent_page_num;
+}
+
+void internal_node_rebalance(Table* table, uint32_t page_num);
+
+/*
+Bulk loading can leave a node as the only child of its parent.
+Borrowing and merging need a sibling, so such a parent is rebalanced
+first, which gives it more children or removes it altogether.
+*/
+void node_ensure_sibling(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  while (page_num != table->root_page_num) {
+    void* node = get_page(pager, page_num);
+    uint32_t parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num, false);
+
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    unpin_page(pager, parent_page_num, false);
+    if (num_keys > 0) {
+      return;
+    }
+    internal_node_rebalance(table, parent_page_num);
+  }
+}
+
+/*
+The absorbed node's entries have been moved into the survivor, its
+left neighbour. Drop the absorbed node from the parent and rebalance
+the parent.
+*/
+void node_finish_merge(Table* table, uint32_t parent_page_num,
+                       uint32_t survivor_page_num,
+                       uint32_t absorbed_page_num) {
+  Pager* pager = table->pager;
+  void* parent = get_page(pager, parent_page_num);
+  internal_node_remove_child(
+      table, parent, internal_node_child_index(parent, absorbed_page_num));
+  unpin_page(pager, parent_page_num, true);
+  pager_free_page(pager, absorbed_page_num);
+
+  update_node_max_key(table, survivor_page_num);
+  internal_node_rebalance(table, parent_page_num);
+}
+
+void leaf_node_rebalance(Table* table, uint32_t page_num) {
+  /*
+  Pair the leaf with its left sibling, or its right one if it is the
+  first child. If both fit in one page they are merged into the left
+  one. Otherwise the cells of the two are spread evenly between them,
+  which moves cells over from the sibling.
+  */
+  Pager* pager = table->pager;
+  uint32_t left_page_num, right_page_num;
+  uint32_t parent_page_num =
+      node_siblings(table, page_num, &left_page_num, &right_page_num);
+  if (left_page_num != INVALID_PAGE_NUM) {
+    right_page_num = page_num;
+  } else {
+    left_page_num = page_num;
+  }
+  table_latch_page(table, left_page_num);
+  table_latch_page(table, right_page_num);
+
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  uint32_t left_num_cells = *leaf_node_num_cells(left);
+  uint32_t right_num_cells = *leaf_node_num_cells(right);
+
+  if (leaf_node_used_space(left) + leaf_node_used_space(right) <=
+      LEAF_NODE_SPACE_FOR_CELLS) {
+    for (uint32_t i = 0; i < right_num_cells; i++) {
+      leaf_node_append_cell(left, leaf_node_cell(right, i));
+    }
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    unpin_page(pager, right_page_num, false);
+    unpin_page(pager, left_page_num, true);
+
+    node_finish_merge(table, parent_page_num, left_page_num, right_page_num);
+    return;
+  }
+
+  uint8_t left_copy[PAGE_SIZE];
+  uint8_t right_copy[PAGE_SIZE];
+  memcpy(left_copy, left, PAGE_SIZE);
+  memcpy(right_copy, right, PAGE_SIZE);
+  void* cells[2 * LEAF_NODE_MAX_CELLS];
+  for (uint32_t i = 0; i < left_num_cells; i++) {
+    cells[i] = leaf_node_cell(left_copy, i);
+  }
+  for (uint32_t i = 0; i < right_num_cells; i++) {
+    cells[left_num_cells + i] = leaf_node_cell(right_copy, i);
+  }
+  leaf_node_clear(left);
+  leaf_node_clear(right);
+  leaf_node_distribute(cells, left_num_cells + right_num_cells, left, right);
+  unpin_page(pager, right_page_num, true);
+  unpin_page(pager, left_page_num, true);
+
+  update_node_max_key(table, left_page_num);
+  update_node_max_key(table, right_page_num);
+}
+
+void internal_node_set_parent_of_children(Pager* pager, void* node,
+                                          uint32_t page_num, uint32_t first) {
+  for (uint32_t i = first; i <= *internal_node_num_keys(node); i++) {
+    uint32_t child_page_num = *internal_node_child(node, i);
+    void* child = get_page(pager, child_page_num);
+    *node_parent(child) = page_num;
+    unpin_page(pager, child_page_num, true);
+  }
+}
+
+void internal_node_rebalance(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t only_child_page_num = *internal_node_right_child(node);
+  unpin_page(pager, page_num, false);
+
+  if (page_num == table->root_page_num) {
+    if (num_keys == 0) {
+      /* The only child becomes the new root */
+      void* child = get_page(pager, only_child_page_num);
+      set_node_root(child, true);
+      unpin_page(pager, only_child_page_num, true);
+      table_set_root(table, only_child_page_num);
+      pager_free_page(pager, page_num);
+    }
+    return;
+  }
+  if (num_keys + 1 >= internal_node_min_children(table)) {
+    return;
+  }
+
+  node_ensure_sibling(table, page_num);
+  if (page_num == table->root_page_num) {
+    internal_node_rebalance(table, page_num);
+    return;
+  }
+
+  uint32_t left_page_num, right_page_num;
+  uint32_t parent_page_num =
+      node_siblings(table, page_num, &left_page_num, &right_page_num);
+  node = get_page(pager, page_num);
+  num_keys = *internal_node_num_keys(node);
+
+  if (left_page_num != INVALID_PAGE_NUM) {
+    table_latch_page(table, left_page_num);
+    void* left = get_page(pager, left_page_num);
+    uint32_t left_num_keys = *internal_node_num_keys(left);
+    if (left_num_keys + 1 > internal_node_min_children(table)) {
+      /* Borrow the right child of the left sibling */
+      uint32_t child_page_num = *internal_node_right_child(left);
+      uint64_t child_max_key = get_node_max_key(table, left);
+      *internal_node_right_child(left) =
+          *internal_node_child(left, left_num_keys - 1);
+      *internal_node_num_keys(left) = left_num_keys - 1;
+
+      internal_node_move_cells(table, node, 1, node, 0, num_keys);
+      *internal_node_num_keys(node) = num_keys + 1;
+      *internal_node_child(node, 0) = child_page_num;
+      internal_node_set_key(table, node, 0, child_max_key);
+      unpin_page(pager, left_page_num, true);
+
+      void* child = get_page(pager, child_page_num);
+      *node_parent(child) = page_num;
+      unpin_page(pager, child_page_num, true);
+      unpin_page(pager, page_num, true);
+
+      update_node_max_key(table, left_page_num);
+      return;
+    }
+    unpin_page(pager, left_page_num, false);
+  }
+
+  if (right_page_num != INVALID_PAGE_NUM) {
+    table_latch_page(table, right_page_num);
+    void* right = get_page(pager, right_page_num);
+    uint32_t right_num_keys = *internal_node_num_keys(right);
+    if (right_num_keys + 1 > internal_node_min_children(table)) {
+      /* Borrow the first child of the right sibling */
+      uint32_t child_page_num = *internal_node_child(right, 0);
+      internal_node_move_cells(table, right, 0, right, 1, right_num_keys - 1);
+      *internal_node_num_keys(right) = right_num_keys - 1;
+      unpin_page(pager, right_page_num, true);
+
+      uint64_t node_max_key = get_node_max_key(table, node);
+      uint32_t right_child_page_num = *internal_node_right_child(node);
+      *internal_node_num_keys(node) = num_keys + 1;
+      *internal_node_child(node, num_keys) = right_child_page_num;
+      internal_node_set_key(table, node, num_keys, node_max_key);
+      *internal_node_right_child(node) = child_page_num;
+
+      void* child = get_page(pager, child_page_num);
+      *node_parent(child) = page_num;
+      unpin_page(pager, child_page_num, true);
+      unpin_page(pager, page_num, true);
+
+      update_node_max_key(table, page_num);
+      return;
+    }
+    unpin_page(pager, right_page_num, false);
+  }
+  unpin_page(pager, page_num, false);
+
+  /*
+  Neither sibling can spare a child. Merge into the left one. The
+  survivor's right child becomes an ordinary cell keyed by the
+  survivor's max key, followed by all of the absorbed node's children.
+  */
+  uint32_t survivor_page_num = page_num;
+  uint32_t absorbed_page_num = right_page_num;
+  if (left_page_num != INVALID_PAGE_NUM) {
+    survivor_page_num = left_page_num;
+    absorbed_page_num = page_num;
+  }
+
+  void* survivor = get_page(pager, survivor_page_num);
+  void* absorbed = get_page(pager, absorbed_page_num);
+  uint32_t survivor_num_keys = *internal_node_num_keys(survivor);
+  uint32_t absorbed_num_keys = *internal_node_num_keys(absorbed);
+  uint64_t survivor_max_key = get_node_max_key(table, survivor);
+  uint32_t survivor_right_child_page_num = *internal_node_right_child(survivor);
+
+  *internal_node_num_keys(survivor) =
+      survivor_num_keys + 1 + absorbed_num_keys;
+  *internal_node_child(survivor, survivor_num_keys) =
+      survivor_right_child_page_num;
+  internal_node_set_key(table, survivor, survivor_num_keys, survivor_max_key);
+  internal_node_move_cells(table, survivor, survivor_num_keys + 1, absorbed, 0,
+                           absorbed_num_keys);
+  *internal_node_right_child(survivor) = *internal_node_right_child(absorbed);
+  unpin_page(pager, absorbed_page_num, false);
+
+  internal_node_set_parent_of_children(pager, survivor, survivor_page_num,
+                                       survivor_num_keys + 1);
+  unpin_page(pager, survivor_page_num, true);
+
+  node_finish_merge(table, parent_page_num, survivor_page_num,
+                    absorbed_page_num);
+}
+
+/*
+Remove the row with the given key. Return false if there is none.
+The writer keeps every node it changes latched until the tree is
+balanced again: the path down, and any sibling it borrows from or
+merges with.
+*/
+bool table_delete(Table* table, uint64_t key) {
+  /* Merges may free the rightmost leaf */
+  Pager* pager = table->pager;
+  table->append_leaf = INVALID_PAGE_NUM;
+  Cursor cursor;
+  table_find_for_write(&cursor, table, key, false);
+  uint32_t page_num = cursor.page_num;
+  uint32_t cell_num = cursor.cell_num;
+  cursor_close(&cursor);
+
+  void* node = get_page(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool found = cell_num < num_cells &&
+               leaf_node_cell_key(table, node, cell_num) == key;
+  uint32_t space_left = 0;
+  if (found) {
+    space_left =
+        leaf_node_used_space(node) - leaf_node_cell_size(node, cell_num);
+  }
+  unpin_page(pager, page_num, false);
+  if (!found) {
+    table_unlatch_all(table);
+    return false;
+  }
+
+  bool underfull = space_left < LEAF_NODE_MIN_SPACE;
+  if (underfull) {
+    /* Done before the cell goes, since an empty leaf has no max key */
+    node_ensure_sibling(table, page_num);
+  }
+
+  node = get_page(pager, page_num);
+  leaf_node_remove_cell(node, cell_num);
+  unpin_page(pager, page_num, true);
+
+  if (page_num != table->root_page_num) {
+    if (underfull) {
+      leaf_node_rebalance(table, page_num);
+    } else if (cell_num == num_cells - 1) {
+      update_node_max_key(table, page_num);
+    }
+  }
+  table_unlatch_all(table);
+  return true;
+}
+
+/*
+ * Integrity check. Each tree is walked one level at a time at a
+ * snapshot, and every level is split between worker threads that read
+ * their pages straight from the WAL and the db file, past the buffer
+ * pool. A node is checked against what its parent says about it: its
+ * parent pointer and the range its keys must fall in. The leaves of a
+ * tree must then be chained in key order, and every page must be used
+ * exactly once, by the header, a tree or the freelist.
+ */
+#define CHECK_MIN_NODES_PER_THREAD 64
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t parent_page_num;  // INVALID_PAGE_NUM at the root
+  uint64_t min_key;          // every key under it is in [min_key, max_key]
+  uint64_t max_key;
+} CheckNode;
+
+typedef struct {
+  Table* tree;  // the table or index being checked, for its key width
+  Snapshot snapshot;
+  uint8_t* page_used;  // one flag per page, shared by all the workers
+  uint32_t num_pages;
+  CheckNode* nodes;       // the worker's share of the level
+  uint32_t* next_leaves;  // each one's sibling link, INVALID_PAGE_NUM if none
+  uint32_t num_nodes;
+  CheckNode* children;  // the level below the share, in key order
+  uint32_t num_children;
+  uint32_t children_capacity;
+  uint32_t num_leaves;
+  uint32_t num_internal_nodes;
+  uint32_t num_problems;
+} CheckWorker;
+
+/* Claim the page for its one use. Returns false if it cannot be. */
+bool check_use_page(uint8_t* page_used, uint32_t num_pages, uint32_t page_num,
+                    uint32_t* num_problems) {
+  if (page_num >= num_pages) {
+    printf("Page %u is past the end of the file.\n", page_num);
+    (*num_problems)++;
+    return false;
+  }
+  if (__atomic_exchange_n(&page_used[page_num], 1, __ATOMIC_RELAXED)) {
+    printf("Page %u is used more than once.\n", page_num);
+    (*num_problems)++;
+    return false;
+  }
+  return true;
+}
+
+void check_leaf(CheckWorker* worker, CheckNode* expected, void* node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t content_start = *leaf_node_content_start(node);
+  if (num_cells > LEAF_NODE_MAX_CELLS || content_start > PAGE_USABLE_SIZE ||
+      content_start < LEAF_NODE_HEADER_SIZE + num_cells * LEAF_NODE_SLOT_SIZE) {
+    printf("Leaf %u has a corrupt header.\n", expected->page_num);
+    worker->num_problems++;
+    return;
+  }
+
+  uint64_t min_key = expected->min_key;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint32_t offset = *leaf_node_slot(node, i);
+    if (offset < content_start || offset + ROW_MIN_SIZE > PAGE_USABLE_SIZE ||
+        offset + serialized_row_size(node + offset) > PAGE_USABLE_SIZE) {
+      printf("Leaf %u has a cell outside its content.\n", expected->page_num);
+      worker->num_problems++;
+      return;
+    }
+    uint64_t key = leaf_node_cell_key(worker->tree, node, i);
+    if (key < min_key || key > expected->max_key) {
+      printf("Leaf %u has key %lu out of order.\n", expected->page_num,
+             (unsigned long)key);
+      worker->num_problems++;
+      return;
+    }
+    min_key = key + 1;
+  }
+}
+
+void check_internal(CheckWorker* worker, CheckNode* expected, void* node) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (num_keys > internal_node_max_cells(worker->tree)) {
+    printf("Internal node %u has a corrupt header.\n", expected->page_num);
+    worker->num_problems++;
+    return;
+  }
+
+  /* Child i holds the keys above key i - 1, up to and including key i */
+  uint64_t min_key = expected->min_key;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    uint64_t max_key = expected->max_key;
+    if (i < num_keys) {
+      uint64_t key = internal_node_key(worker->tree, node, i);
+      if (key < min_key || key > expected->max_key) {
+        printf("Internal node %u has key %lu out of order.\n",
+               expected->page_num, (unsigned long)key);
+        worker->num_problems++;
+        return;
+      }
+      max_key = key;
+    }
+
+    uint32_t child_page_num = *internal_node_child(node, i);
+    if (check_use_page(worker->page_used, worker->num_pages, child_page_num,
+                       &worker->num_problems)) {
+      if (worker->num_children == worker->children_capacity) {
+        worker->children_capacity =
+            worker->children_capacity ? worker->children_capacity * 2 : 64;
+        worker->children = realloc(
+            worker->children, worker->children_capacity * sizeof(CheckNode));
+      }
+      CheckNode child = {child_page_num, expected->page_num, min_key, max_key};
+      worker->children[worker->num_children++] = child;
+    }
+    min_key = max_key + 1;
+  }
+}
+
+void* check_worker_main(void* argument) {
+  CheckWorker* worker = argument;
+  void* node = malloc(PAGE_SIZE);
+  for (uint32_t i = 0; i < worker->num_nodes; i++) {
+    CheckNode* expected = &worker->nodes[i];
+    uint32_t page_num = expected->page_num;
+    worker->next_leaves[i] = INVALID_PAGE_NUM;
+    if (!pager_try_read_snapshot(worker->tree->pager, worker->snapshot,
+                                 page_num, node)) {
+      printf("Page %u failed its checksum.\n", page_num);
+      worker->num_problems++;
+      continue;
+    }
+
+    bool is_root = expected->parent_page_num == INVALID_PAGE_NUM;
+    if (is_node_root(node) != is_root) {
+      printf("Page %u has the wrong root flag.\n", page_num);
+      worker->num_problems++;
+    }
+    if (!is_root && *node_parent(node) != expected->parent_page_num) {
+      printf("Page %u points to parent %u instead of %u.\n", page_num,
+             *node_parent(node), expected->parent_page_num);
+      worker->num_problems++;
+    }
+
+    switch (get_node_type(node)) {
+      case NODE_LEAF:
+        worker->num_leaves++;
+        worker->next_leaves[i] = *leaf_node_next_leaf(node);
+        check_leaf(worker, expected, node);
+        break;
+      case NODE_INTERNAL:
+        worker->num_internal_nodes++;
+        check_internal(worker, expected, node);
+        break;
+      default:
+        printf("Page %u is not a tree node.\n", page_num);
+        worker->num_problems++;
+        break;
+    }
+  }
+  free(node);
+  return NULL;
+}
+
+uint32_t check_tree(Table* tree, Snapshot snapshot, uint8_t* page_used,
+                    uint32_t num_pages, uint32_t root_page_num,
+                    uint32_t num_threads) {
+  uint32_t num_problems = 0;
+  if (!check_use_page(page_used, num_pages, root_page_num, &num_problems)) {
+    return num_problems;
+  }
+  CheckNode* level = malloc(sizeof(CheckNode));
+  CheckNode root = {root_page_num, INVALID_PAGE_NUM, 0, table_max_key(tree)};
+  level[0] = root;
+  uint32_t level_size = 1;
+
+  while (level_size > 0) {
+    uint32_t num_workers = (level_size + CHECK_MIN_NODES_PER_THREAD - 1) /
+                           CHECK_MIN_NODES_PER_THREAD;
+    if (num_workers > num_threads) {
+      num_workers = num_threads;
+    }
+    CheckWorker workers[num_workers];
+    pthread_t threads[num_workers];
+    uint32_t* next_leaves = malloc(level_size * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_workers; i++) {
+      uint32_t first = (uint64_t)level_size * i / num_workers;
+      uint32_t end = (uint64_t)level_size * (i + 1) / num_workers;
+      CheckWorker* worker = &workers[i];
+      memset(worker, 0, sizeof(CheckWorker));
+      worker->tree = tree;
+      worker->snapshot = snapshot;
+      worker->page_used = page_used;
+      worker->num_pages = num_pages;
+      worker->nodes = level + first;
+      worker->next_leaves = next_leaves + first;
+      worker->num_nodes = end - first;
+      if (num_workers > 1) {
+        pthread_create(&threads[i], NULL, check_worker_main, &workers[i]);
+      } else {
+        check_worker_main(&workers[i]);
+      }
+    }
+
+    uint32_t num_leaves = 0;
+    uint32_t num_internal_nodes = 0;
+    uint32_t num_children = 0;
+    for (uint32_t i = 0; i < num_workers; i++) {
+      if (num_workers > 1) {
+        pthread_join(threads[i], NULL);
+      }
+      num_leaves += workers[i].num_leaves;
+      num_internal_nodes += workers[i].num_internal_nodes;
+      num_children += workers[i].num_children;
+      num_problems += workers[i].num_problems;
+    }
+
+    if (num_internal_nodes == 0) {
+      for (uint32_t i = 0; i < level_size; i++) {
+        uint32_t next = i + 1 < level_size ? level[i + 1].page_num : 0;
+        if (next_leaves[i] != INVALID_PAGE_NUM && next_leaves[i] != next) {
+          printf("Leaf %u links to %u instead of %u.\n", level[i].page_num,
+                 next_leaves[i], next);
+          num_problems++;
+        }
+      }
+    } else if (num_leaves > 0) {
+      /* The levels below go on being checked all the same */
+      printf("The leaves under page %u are at different depths.\n",
+             root_page_num);
+      num_problems++;
+    }
+
+    CheckNode* next_level = malloc((num_children + 1) * sizeof(CheckNode));
+    uint32_t next_level_size = 0;
+    for (uint32_t i = 0; i < num_workers; i++) {
+      memcpy(next_level + next_level_size, workers[i].children,
+             workers[i].num_children * sizeof(CheckNode));
+      next_level_size += workers[i].num_children;
+      free(workers[i].children);
+    }
+    free(next_leaves);
+    free(level);
+    level = next_level;
+    level_size = next_level_size;
+  }
+  free(level);
+  return num_problems;
+}
+
+uint32_t check_freelist(Pager* pager, Snapshot snapshot, uint8_t* page_used,
+                        uint32_t num_pages, FileHeader* header) {
+  uint32_t num_problems = 0;
+  uint32_t num_free_pages = 0;
+  FreelistTrunk* trunk = malloc(PAGE_SIZE);
+  uint32_t trunk_page_num = header->freelist_trunk_page_num;
+  while (trunk_page_num != 0) {
+    if (!check_use_page(page_used, num_pages, trunk_page_num,
+                        &num_problems)) {
+      break;
+    }
+    if (!pager_try_read_snapshot(pager, snapshot, trunk_page_num, trunk)) {
+      printf("Page %u failed its checksum.\n", trunk_page_num);
+      num_problems++;
+      break;
+    }
+    if (trunk->num_leaves > FREELIST_TRUNK_MAX_LEAVES) {
+      printf("Freelist trunk %u has a corrupt header.\n", trunk_page_num);
+      num_problems++;
+      break;
+    }
+    for (uint32_t i = 0; i < trunk->num_leaves; i++) {
+      check_use_page(page_used, num_pages, trunk->leaves[i], &num_problems);
+    }
+    num_free_pages += trunk->num_leaves + 1;
+    trunk_page_num = trunk->next_trunk_page_num;
+  }
+  free(trunk);
+
+  if (trunk_page_num == 0 && num_free_pages != header->num_free_pages) {
+    printf("The header counts %u free pages, but the freelist has %u.\n",
+           header->num_free_pages, num_free_pages);
+    num_problems++;
+  }
+  return num_problems;
+}
+
+/*
+Check the table, its indexes and the freelist as of their last commit,
+printing each problem found. Returns the number of problems. The caller
+holds write_mutex, so the committed size cannot change meanwhile.
+*/
+uint32_t table_check(Table* table, uint32_t num_threads) {
+  Pager* pager = table->pager;
+  uint32_t num_pages = pager->committed_num_pages;
+  Snapshot snapshot = pager_snapshot_begin(pager);
+  uint8_t* page_used = calloc(num_pages, 1);
+  page_used[HEADER_PAGE_NUM] = 1;
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+
+  uint32_t num_problems = 0;
+  FileHeader* header = malloc(PAGE_SIZE);
+  if (!pager_try_read_snapshot(pager, snapshot, HEADER_PAGE_NUM, header)) {
+    printf("Page %u failed its checksum.\n", HEADER_PAGE_NUM);
+    num_problems++;
+  } else {
+    num_problems += check_tree(table, snapshot, page_used, num_pages,
+                               header->root_page_num, num_threads);
+    for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+      if (header->index_root_page_nums[i] != 0) {
+        num_problems +=
+            check_tree(table->indexes[i], snapshot, page_used, num_pages,
+                       header->index_root_page_nums[i], num_threads);
+      }
+    }
+    num_problems +=
+        check_freelist(pager, snapshot, page_used, num_pages, header);
+
+    uint32_t num_lost_pages = 0;
+    for (uint32_t page_num = 0; page_num < num_pages; page_num++) {
+      num_lost_pages += !page_used[page_num];
+    }
+    if (num_lost_pages > 0) {
+      printf("%u pages are neither in use nor free.\n", num_lost_pages);
+      num_problems++;
+    }
+  }
+
+  free(header);
+  free(page_used);
+  pager_snapshot_end(pager, snapshot);
+  return num_problems;
+}
@@ -0,0 +1,153 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libdb.h"
+#include "pager.h"
+
+#define TABLE_MAX_LATCHED_PAGES 64
+
+/*
+ * Any number of threads may read a table while one writes to it.
+ * Readers latch pages shared and hold at most a node and its child at
+ * once. Writers take write_mutex, so there is only ever one, and latch
+ * every page they change exclusively. Bulk loading and vacuum change
+ * pages without latching them, so they must not run alongside readers.
+ *
+ * An explicit transaction holds write_mutex from db_begin() until it
+ * commits or rolls back. The mutex is recursive, so the owner's writes
+ * inside it go through as usual. Other threads read at a snapshot of
+ * the last commit until it ends. A read decides between the snapshot
+ * and the buffer pool under transaction_lock, shared, and keeps it
+ * until done. db_begin() takes it exclusively to open the transaction,
+ * so no read that chose the buffer pool is still in it afterwards.
+ */
+struct Table {
+  Pager* pager;
+  uint32_t root_page_num;  // read with table_root() outside the writer
+  /*
+   * An index is a Table of its own over the same pager, with its root
+   * in the file header's slot for its column. Only the table itself
+   * has indexes, write_mutex and a transaction.
+   */
+  bool is_index;
+  DbColumn indexed_column;                 // is_index only
+  Table* indexes[DB_NUM_INDEXED_COLUMNS];  // root_page_num 0 if not built
+  pthread_mutex_t write_mutex;
+  pthread_rwlock_t transaction_lock;
+  bool in_transaction;  // set and cleared under write_mutex, read atomically
+  pthread_t transaction_owner;
+  uint32_t latched_pages[TABLE_MAX_LATCHED_PAGES];  // held by the writer
+  uint32_t num_latched_pages;
+  uint32_t append_leaf;  // the writer's rightmost leaf, or INVALID_PAGE_NUM
+  Cursor* spare_cursor;  // closed by db_cursor_close(), reused by open
+};
+
+/*
+ * A cursor holds on to its current leaf until cursor_close(), in one of
+ * three ways. The writer's cursors keep it pinned, since the table holds
+ * the writer's latches. A latched cursor also holds the leaf's shared
+ * latch, so the thread that opened it must close it before writing. A
+ * snapshot cursor reads a private copy of each leaf as it was when the
+ * cursor was opened, and holds nothing in the buffer pool.
+ *
+ * Cursors live wherever the caller keeps them, usually on its stack.
+ * The functions that position one fill in the caller's, and
+ * cursor_close() lets go of what it holds but not of the cursor, so
+ * no lookup or scan allocates memory.
+ */
+typedef enum { CURSOR_WRITER, CURSOR_LATCHED, CURSOR_SNAPSHOT } CursorMode;
+
+struct Cursor {
+  Table* table;
+  uint32_t page_num;
+  uint32_t cell_num;
+  void* node;  // the leaf, or the cursor's copy of it
+  CursorMode mode;
+  Snapshot snapshot;  // CURSOR_SNAPSHOT only
+  uint64_t last_key;  // a range scan ends after this key
+  uint32_t leaves_visited;
+  uint32_t readahead_depth;  // current readahead window, in leaves
+  uint32_t readahead_ahead;  // leaves of the window not reached yet
+  uint64_t opened_ns;        // when db_cursor_open() opened it
+  bool end_of_table;  // Indicates a position one past the last element
+  uint8_t page_copy[PAGE_SIZE] __attribute__((aligned(8)));  // snapshot only
+};
+
+typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+
+#define BULK_LOAD_MAX_LEVELS 32
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t num_children;
+  uint64_t right_child_max_key;
+} BulkLoadLevel;
+
+struct BulkLoader {
+  Table* table;
+  uint32_t leaf_fill;      // bytes per leaf
+  uint32_t internal_fill;  // children per internal node
+  uint32_t leaf_page_num;  // open leaf, or INVALID_PAGE_NUM before any row
+  uint64_t last_key;
+  uint32_t num_rows;
+  BulkLoadLevel levels[BULK_LOAD_MAX_LEVELS];  // levels[0] is above leaves
+  uint32_t num_levels;
+};
+
+/*
+ * A prepared insert. Its fields point into the caller's buffers, and
+ * stepping it writes them straight into the leaf.
+ */
+struct DbStatement {
+  Table* table;
+  RowFields fields;
+};
+
+void row_fields(const Row* row, RowFields* fields);
+uint32_t serialize_row_fields(const RowFields* source, void* destination);
+uint32_t serialize_row(const Row* source, void* destination);
+void deserialize_row_fields(void* source, RowFields* destination);
+void deserialize_row(void* source, Row* destination);
+
+void set_node_root(void* node, bool is_root);
+void initialize_leaf_node(void* node);
+uint32_t* leaf_node_num_cells(void* node);
+uint32_t* leaf_node_key(void* node, uint32_t cell_num);
+uint64_t leaf_node_cell_key(Table* table, void* node, uint32_t cell_num);
+bool table_is_empty(Table* table);
+uint32_t table_root(Table* table);
+uint32_t* table_header_root(Table* table, FileHeader* header);
+void table_set_root(Table* table, uint32_t root_page_num);
+void table_create_root(Table* table);
+uint32_t table_vacuum(Table* table, uint32_t max_pages);
+uint32_t table_check(Table* table, uint32_t num_threads);
+uint32_t table_height(Table* table);
+bool table_delete(Table* table, uint64_t key);
+
+void table_find(Cursor* cursor, Table* table, uint64_t key);
+void table_find_for_write(Cursor* cursor, Table* table, uint64_t key,
+                          bool is_insert);
+void table_unlatch_all(Table* table);
+void table_start(Cursor* cursor, Table* table);
+void table_seek(Cursor* cursor, Table* table, uint64_t key);
+bool table_seek_snapshot(Cursor* cursor, Table* table, uint64_t key);
+void* cursor_value(Cursor* cursor);
+uint64_t cursor_key(Cursor* cursor);
+void cursor_set_last_key(Cursor* cursor, uint64_t last_key);
+void cursor_advance(Cursor* cursor);
+void cursor_close(Cursor* cursor);
+
+void leaf_node_insert(Cursor* cursor, uint64_t key, const RowFields* value);
+
+void bulk_load_init(BulkLoader* loader, Table* table, uint32_t fill_factor);
+void bulk_load_append(BulkLoader* loader, const Row* row);
+void bulk_load_append_fields(BulkLoader* loader, const RowFields* fields);
+void bulk_load_finish(BulkLoader* loader);
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+void print_constants();
+
+#endif
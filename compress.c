@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "compress.h"
+
+uint32_t compress_hash(const uint8_t* bytes) {
+  uint32_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return (word * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/* How far the bytes at a and b agree, stopping at end */
+uint32_t compress_match_length(const uint8_t* a, const uint8_t* b,
+                               const uint8_t* end) {
+  const uint8_t* start = b;
+  while (end - b >= 8 && memcmp(a, b, 8) == 0) {
+    a += 8;
+    b += 8;
+  }
+  while (b < end && *a == *b) {
+    a++;
+    b++;
+  }
+  return b - start;
+}
+
+uint8_t* compress_put_length(uint8_t* out, uint32_t length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = length;
+  return out;
+}
+
+/* Append a sequence. A match_length of 0 makes it the last one. */
+uint8_t* compress_put_sequence(uint8_t* out, const uint8_t* literals,
+                               uint32_t num_literals, uint32_t offset,
+                               uint32_t match_length) {
+  uint32_t extra_match = match_length ? match_length - COMPRESS_MIN_MATCH : 0;
+  uint8_t* token = out++;
+  *token = (num_literals < 15 ? num_literals : 15) << 4;
+  if (num_literals >= 15) {
+    out = compress_put_length(out, num_literals - 15);
+  }
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+
+  if (match_length != 0) {
+    *token |= extra_match < 15 ? extra_match : 15;
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (extra_match >= 15) {
+      out = compress_put_length(out, extra_match - 15);
+    }
+  }
+  return out;
+}
+
+/*
+Compress a page into out, which must have room for PAGE_COMPRESS_BOUND
+bytes, and return the compressed size. Matches are found through a
+table of the last position each hash of four bytes was seen at. After
+every 64 misses in a row the search skips further ahead, so a page
+that does not compress costs little more than a copy.
+*/
+uint32_t page_compress(const void* page, void* out) {
+  const uint8_t* in = page;
+  const uint8_t* end = in + PAGE_SIZE;
+  uint16_t last_seen[1 << COMPRESS_HASH_BITS];
+  memset(last_seen, 0, sizeof(last_seen));
+
+  uint8_t* output = out;
+  uint32_t anchor = 0;
+  uint32_t position = 0;
+  uint32_t misses = 0;
+  while (position + COMPRESS_MIN_MATCH <= PAGE_SIZE) {
+    uint32_t hash = compress_hash(in + position);
+    uint32_t candidate = last_seen[hash];
+    last_seen[hash] = position;
+    if (candidate >= position ||
+        memcmp(in + candidate, in + position, COMPRESS_MIN_MATCH) != 0) {
+      position += 1 + (misses++ >> 6);
+      continue;
+    }
+
+    misses = 0;
+    uint32_t length =
+        COMPRESS_MIN_MATCH +
+        compress_match_length(in + candidate + COMPRESS_MIN_MATCH,
+                              in + position + COMPRESS_MIN_MATCH, end);
+    output = compress_put_sequence(output, in + anchor, position - anchor,
+                                   position - candidate, length);
+    position += length;
+    anchor = position;
+  }
+  output = compress_put_sequence(output, in + anchor, PAGE_SIZE - anchor, 0, 0);
+  return output - (uint8_t*)out;
+}
+
+bool decompress_get_length(const uint8_t** data, const uint8_t* end,
+                           uint32_t* length) {
+  uint8_t byte;
+  do {
+    if (*data == end) {
+      return false;
+    }
+    byte = *(*data)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/*
+Copy length bytes in steps of 16, which may write up to 15 bytes past
+the end, and read as far past the end of in. Away from the ends of the
+buffers this is much cheaper than a memcpy of a short, variable length.
+*/
+void decompress_wild_copy(uint8_t* out, const uint8_t* in, uint32_t length) {
+  uint8_t* end = out + length;
+  do {
+    memcpy(out, in, 16);
+    out += 16;
+    in += 16;
+  } while (out < end);
+}
+
+/*
+Decompress size bytes of data into a page. Returns false unless they
+decode to exactly one page, without reading or writing out of bounds.
+*/
+bool page_decompress(const void* data, uint32_t size, void* page) {
+  const uint8_t* in = data;
+  const uint8_t* in_end = in + size;
+  uint8_t* out = page;
+  uint8_t* out_end = out + PAGE_SIZE;
+  while (in < in_end) {
+    uint8_t token = *in++;
+    uint32_t length = token >> 4;
+    if (length == 15 && !decompress_get_length(&in, in_end, &length)) {
+      return false;
+    }
+    if (length > (size_t)(in_end - in) || length > (size_t)(out_end - out)) {
+      return false;
+    }
+    if (length + 16 <= (size_t)(in_end - in) &&
+        length + 16 <= (size_t)(out_end - out)) {
+      decompress_wild_copy(out, in, length);
+    } else {
+      memcpy(out, in, length);
+    }
+    in += length;
+    out += length;
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return false;
+    }
+    uint32_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    length = token & 15;
+    if (length == 15 && !decompress_get_length(&in, in_end, &length)) {
+      return false;
+    }
+    length += COMPRESS_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(out - (uint8_t*)page) ||
+        length > (size_t)(out_end - out)) {
+      return false;
+    }
+
+    const uint8_t* match = out - offset;
+    if (offset >= 16 && length + 16 <= (size_t)(out_end - out)) {
+      decompress_wild_copy(out, match, length);
+      out += length;
+      continue;
+    }
+    if (offset == 1) {
+      memset(out, *match, length);
+      out += length;
+      continue;
+    }
+    /*
+    A copy longer than its offset repeats the last offset bytes. Each
+    chunk copied doubles the repeated run it can be copied from.
+    */
+    while (length > 0) {
+      uint32_t chunk = out - match;
+      if (chunk > length) {
+        chunk = length;
+      }
+      memcpy(out, match, chunk);
+      out += chunk;
+      length -= chunk;
+    }
+  }
+  return out == out_end;
+}
@@ -0,0 +1,32 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pager.h"
+
+/*
+ * Page compression for the WAL. A page is encoded LZ77 style, as a
+ * series of sequences, each a run of literal bytes followed by a copy
+ * of earlier output:
+ *
+ *   token: literal count in the high four bits, match length minus
+ *          COMPRESS_MIN_MATCH in the low four, 15 meaning more follow
+ *   more literal count: bytes added to 15, continued while 255
+ *   literals
+ *   offset: two bytes, little-endian, back from the end of the output
+ *   more match length: as for the literal count
+ *
+ * The last sequence is literals only and ends the input. The free
+ * space in the middle of a slotted page becomes a single match.
+ */
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_HASH_BITS 12
+/* Room page_compress() may need, for a page that does not compress */
+#define PAGE_COMPRESS_BOUND (PAGE_SIZE + PAGE_SIZE / 255 + 16)
+
+uint32_t page_compress(const void* page, void* out);
+bool page_decompress(const void* data, uint32_t size, void* page);
+
+#endif
@@ -1,12 +1,14 @@
 #include <errno.h>
-#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#include "libdb.h"
+
 typedef struct {
   char* buffer;
   size_t buffer_length;
@@ -16,6 +18,9 @@ typedef struct {
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_TRANSACTION_OPEN,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_INDEX_EXISTS,
 } ExecuteResult;
 
 typedef enum {
@@ -31,473 +36,186 @@ typedef enum {
   PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
-
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-typedef struct {
-  uint32_t id;
-  char username[COLUMN_USERNAME_SIZE + 1];
-  char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
-
-typedef struct {
-  StatementType type;
-  Row row_to_insert;  // only used by insert statement
-} Statement;
-
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
-
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
-
-typedef struct {
-  int file_descriptor;
-  uint32_t file_length;
-  uint32_t num_pages;
-  void* pages[TABLE_MAX_PAGES];
-} Pager;
-
-typedef struct {
-  Pager* pager;
-  uint32_t root_page_num;
-} Table;
-
-typedef struct {
-  Table* table;
-  uint32_t page_num;
-  uint32_t cell_num;
-  bool end_of_table;  // Indicates a position one past the last element
-} Cursor;
-
-void print_row(Row* row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
-
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
-
-/*
- * Common Node Header Layout
- */
-const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
-const uint32_t NODE_TYPE_OFFSET = 0;
-const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint8_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
-
-/*
- * Internal Node Header Layout
- */
-const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
-    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                           INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
-
-/*
- * Internal Node Body Layout
- */
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
-
-/*
- * Leaf Node Header Layout
- */
-const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
-    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_DELETE,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK,
+  STATEMENT_CREATE_INDEX
+} StatementType;
 
 /*
- * Leaf Node Body Layout
+ * Select output is formatted into one buffer, which is written out with
+ * a single write() whenever it fills and at the end of the select,
+ * instead of going through printf() row by row. .mode picks the format:
+ *
+ *   text    (id, username, email) per line
+ *   csv     a header line, then id,username,email per line, each field
+ *           quoted if it holds a comma, quote or line break
+ *   binary  per row, its size as two bytes, then the id in four bytes,
+ *           the sizes of the username and email in a byte each, and the
+ *           strings. Integers are little-endian, and a row size of 0
+ *           ends the result.
  */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+typedef enum { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_BINARY } OutputFormat;
 
-NodeType get_node_type(void* node) {
-  uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
-  return (NodeType)value;
-}
+#define OUTPUT_BUFFER_SIZE 65536
+/* Room for any row in any format, even with every character quoted */
+#define OUTPUT_MAX_ROW_SIZE \
+  (16 + 2 * (COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE) + 8)
 
-void set_node_type(void* node, NodeType type) {
-  uint8_t value = type;
-  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
-}
-
-bool is_node_root(void* node) {
-  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-  return (bool)value;
-}
-
-void set_node_root(void* node, bool is_root) {
-  uint8_t value = is_root;
-  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
-}
-
-uint32_t* node_parent(void* node) { return node + PARENT_POINTER_OFFSET; }
-
-uint32_t* internal_node_num_keys(void* node) {
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
-}
-
-uint32_t* internal_node_right_child(void* node) {
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
-}
-
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
-}
-
-uint32_t* internal_node_child(void* node, uint32_t child_num) {
-  uint32_t num_keys = *internal_node_num_keys(node);
-  if (child_num > num_keys) {
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
-  } else if (child_num == num_keys) {
-    return internal_node_right_child(node);
-  } else {
-    return internal_node_cell(node, child_num);
-  }
-}
-
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
-}
-
-uint32_t* leaf_node_num_cells(void* node) {
-  return node + LEAF_NODE_NUM_CELLS_OFFSET;
-}
-
-uint32_t* leaf_node_next_leaf(void* node) {
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
-}
-
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
-}
-
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
-}
-
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
-}
-
-uint32_t get_node_max_key(void* node) {
-  switch (get_node_type(node)) {
-    case NODE_INTERNAL:
-      return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-    case NODE_LEAF:
-      return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-  }
-}
-
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
-}
-
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
-
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
-
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+typedef struct {
+  OutputFormat format;
+  char* buffer;
+  size_t length;
+} Output;
 
-    pager->pages[page_num] = page;
+typedef struct {
+  StatementType type;
+  DbStatement* insert;  // the session's prepared insert, bound by prepare
+  Output* output;       // the session's select output
+  uint32_t first_id;  // only used by select and delete statements
+  uint32_t last_id;
+  bool has_value;   // select and delete: where column = value as well
+  DbColumn column;  // also used by create index statement
+  char value[COLUMN_EMAIL_SIZE + 1];
+} Statement;
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
+Output* new_output() {
+  Output* output = malloc(sizeof(Output));
+  output->format = OUTPUT_TEXT;
+  output->buffer = malloc(OUTPUT_BUFFER_SIZE);
+  output->length = 0;
+  return output;
+}
+
+void close_output(Output* output) {
+  free(output->buffer);
+  free(output);
+}
+
+void output_flush(Output* output) {
+  /* Whatever printf() still holds was meant to come first */
+  fflush(stdout);
+  size_t written = 0;
+  while (written < output->length) {
+    ssize_t bytes_written = write(STDOUT_FILENO, output->buffer + written,
+                                  output->length - written);
+    if (bytes_written == -1) {
+      printf("Error writing output: %d\n", errno);
+      exit(EXIT_FAILURE);
     }
+    written += bytes_written;
   }
-
-  return pager->pages[page_num];
+  output->length = 0;
 }
 
-void indent(uint32_t level) {
-  for (uint32_t i = 0; i < level; i++) {
-    printf("  ");
+char* output_uint(char* out, uint32_t value) {
+  char digits[10];
+  uint32_t num_digits = 0;
+  do {
+    digits[num_digits++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  while (num_digits > 0) {
+    *out++ = digits[--num_digits];
   }
+  return out;
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys, child;
-
-  switch (get_node_type(node)) {
-    case (NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
-      }
-      break;
-    case (NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        child = *internal_node_child(node, i);
-        print_tree(pager, child, indentation_level + 1);
-
-        indent(indentation_level + 1);
-        printf("- key %d\n", *internal_node_key(node, i));
-      }
-      child = *internal_node_right_child(node);
-      print_tree(pager, child, indentation_level + 1);
+char* output_csv_field(char* out, const char* value, uint32_t size) {
+  bool quote = false;
+  for (uint32_t i = 0; i < size; i++) {
+    char c = value[i];
+    if (c == ',' || c == '"' || c == '\n' || c == '\r') {
+      quote = true;
       break;
-  }
-}
-
-void serialize_row(Row* source, void* destination) {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
-}
-
-void deserialize_row(void* source, Row* destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
-}
-
-void initialize_leaf_node(void* node) {
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
-}
-
-void initialize_internal_node(void* node) {
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
-}
-
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
-  cursor->end_of_table = false;
-
-  // Binary search
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
-    }
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
     }
   }
+  if (!quote) {
+    memcpy(out, value, size);
+    return out + size;
+  }
 
-  cursor->cell_num = min_index;
-  return cursor;
-}
-
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-  /*
-  Return the index of the child which should contain
-  the given key.
-  */
-
-  uint32_t num_keys = *internal_node_num_keys(node);
-
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
-
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
+  *out++ = '"';
+  for (uint32_t i = 0; i < size; i++) {
+    if (value[i] == '"') {
+      *out++ = '"';
     }
+    *out++ = value[i];
   }
-
-  return min_index;
+  *out++ = '"';
+  return out;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-  void* child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+char* output_le(char* out, uint32_t value, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    *out++ = (value >> (8 * i)) & 0xff;
   }
+  return out;
 }
 
-/*
-Return the position of the given key.
-If the key is not present, return the position
-where it should be inserted
-*/
-Cursor* table_find(Table* table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
-
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
-  } else {
-    return internal_node_find(table, root_page_num, key);
+bool output_row(const RowFields* row, void* context) {
+  Output* output = context;
+  if (output->length + OUTPUT_MAX_ROW_SIZE > OUTPUT_BUFFER_SIZE) {
+    output_flush(output);
   }
-}
-
-Cursor* table_start(Table* table) {
-  Cursor* cursor = table_find(table, 0);
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
-
-  return cursor;
-}
-
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
-}
-
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
-
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
-    }
+  char* out = output->buffer + output->length;
+  switch (output->format) {
+    case (OUTPUT_TEXT):
+      *out++ = '(';
+      out = output_uint(out, row->id);
+      *out++ = ',';
+      *out++ = ' ';
+      memcpy(out, row->username, row->username_size);
+      out += row->username_size;
+      *out++ = ',';
+      *out++ = ' ';
+      memcpy(out, row->email, row->email_size);
+      out += row->email_size;
+      *out++ = ')';
+      *out++ = '\n';
+      break;
+    case (OUTPUT_CSV):
+      out = output_uint(out, row->id);
+      *out++ = ',';
+      out = output_csv_field(out, row->username, row->username_size);
+      *out++ = ',';
+      out = output_csv_field(out, row->email, row->email_size);
+      *out++ = '\n';
+      break;
+    case (OUTPUT_BINARY):
+      out = output_le(out, 6 + row->username_size + row->email_size, 2);
+      out = output_le(out, row->id, 4);
+      out = output_le(out, row->username_size, 1);
+      out = output_le(out, row->email_size, 1);
+      memcpy(out, row->username, row->username_size);
+      out += row->username_size;
+      memcpy(out, row->email, row->email_size);
+      out += row->email_size;
+      break;
   }
+  output->length = out - output->buffer;
+  return true;
 }
 
-Pager* pager_open(const char* filename) {
-  int fd = open(filename,
-                O_RDWR |      // Read/Write mode
-                    O_CREAT,  // Create file if it does not exist
-                S_IWUSR |     // User write permission
-                    S_IRUSR   // User read permission
-                );
-
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+void output_begin(Output* output) {
+  if (output->format == OUTPUT_CSV) {
+    static const char header[] = "id,username,email\n";
+    memcpy(output->buffer + output->length, header, sizeof(header) - 1);
+    output->length += sizeof(header) - 1;
   }
-
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
-
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
-  }
-
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
-  }
-
-  return pager;
 }
 
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
-
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
-
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+void output_end(Output* output) {
+  if (output->format == OUTPUT_BINARY) {
+    output->length = output_le(output->buffer + output->length, 0, 2) -
+                     output->buffer;
   }
-
-  return table;
+  output_flush(output);
 }
 
 InputBuffer* new_input_buffer() {
@@ -530,89 +248,155 @@ void close_input_buffer(InputBuffer* input_buffer) {
   free(input_buffer);
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
-  }
-
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
-
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
-}
-
-void db_close(Table* table) {
-  Pager* pager = table->pager;
-
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
+void print_stats(Table* table) {
+  DbStats stats;
+  db_stats(table, &stats);
+  printf("cache: %lu hits, %lu misses, %lu evictions\n", stats.cache_hits,
+         stats.cache_misses, stats.cache_evictions);
+  printf("io: %lu bytes read, %lu bytes written\n", stats.bytes_read,
+         stats.bytes_written);
+  printf("splits: %lu leaf, %lu internal\n", stats.leaf_splits,
+         stats.internal_splits);
+  printf("checkpoints: %lu pages in %lu writes\n", stats.checkpoint_pages,
+         stats.checkpoint_writes);
+  printf("tree height: %u\n", stats.tree_height);
+  for (uint32_t op = 0; op < DB_NUM_OPERATIONS; op++) {
+    if (stats.calls[op] == 0) {
       continue;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
-  }
-
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
-  }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+    printf("%s: %lu calls, mean %lu ns\n", db_operation_name(op),
+           stats.calls[op], stats.total_ns[op] / stats.calls[op]);
+    for (uint32_t b = 0; b < DB_LATENCY_BUCKETS; b++) {
+      if (stats.latency[op][b] == 0) {
+        continue;
+      }
+      if (b == DB_LATENCY_BUCKETS - 1) {
+        printf("  >= %lu ns: %lu\n", 1ul << b, stats.latency[op][b]);
+      } else {
+        printf("  < %lu ns: %lu\n", 2ul << b, stats.latency[op][b]);
+      }
     }
   }
-  free(pager);
-  free(table);
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+#define BULK_LOAD_DEFAULT_FILL_FACTOR 100
+void bulk_load(Table* table, const char* filename, uint32_t fill_factor);
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table,
+                                  Output* output) {
   if (strcmp(input_buffer->buffer, ".exit") == 0) {
     close_input_buffer(input_buffer);
+    close_output(output);
     db_close(table);
     exit(EXIT_SUCCESS);
+  } else if (strcmp(input_buffer->buffer, ".mode") == 0 ||
+             strncmp(input_buffer->buffer, ".mode ", 6) == 0) {
+    char* mode = input_buffer->buffer + 5;
+    if (strcmp(mode, " text") == 0) {
+      output->format = OUTPUT_TEXT;
+    } else if (strcmp(mode, " csv") == 0) {
+      output->format = OUTPUT_CSV;
+    } else if (strcmp(mode, " binary") == 0) {
+      output->format = OUTPUT_BINARY;
+    } else {
+      printf("Usage: .mode text|csv|binary\n");
+    }
+    return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
     printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
+    db_print_tree(table);
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
     printf("Constants:\n");
-    print_constants();
+    db_print_constants();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".cache") == 0) {
+    printf("Cache:\n");
+    db_print_cache_stats(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    printf("Stats:\n");
+    print_stats(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".vacuum") == 0 ||
+             strncmp(input_buffer->buffer, ".vacuum ", 8) == 0) {
+    uint32_t max_pages = UINT32_MAX;
+    if (input_buffer->buffer[7] == ' ') {
+      int max_pages_arg = atoi(input_buffer->buffer + 8);
+      if (max_pages_arg < 1) {
+        printf("Usage: .vacuum [max pages]\n");
+        return META_COMMAND_SUCCESS;
+      }
+      max_pages = max_pages_arg;
+    }
+    printf("Released %d pages.\n", db_vacuum(table, max_pages));
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".check") == 0 ||
+             strncmp(input_buffer->buffer, ".check ", 7) == 0) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (input_buffer->buffer[6] == ' ') {
+      num_threads = atoi(input_buffer->buffer + 7);
+      if (num_threads < 1) {
+        printf("Usage: .check [threads]\n");
+        return META_COMMAND_SUCCESS;
+      }
+    }
+    uint32_t num_problems = db_check(table, num_threads);
+    if (num_problems == 0) {
+      printf("No problems found.\n");
+    } else {
+      printf("Found %d problems.\n", num_problems);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+    char* filename = strtok(input_buffer->buffer + 6, " ");
+    char* fill_factor_string = strtok(NULL, " ");
+    int fill_factor = BULK_LOAD_DEFAULT_FILL_FACTOR;
+    if (fill_factor_string != NULL) {
+      fill_factor = atoi(fill_factor_string);
+    }
+    if (filename == NULL || fill_factor < 1 || fill_factor > 100) {
+      printf("Usage: .load <file> [fill factor 1-100]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    bulk_load(table, filename, fill_factor);
     return META_COMMAND_SUCCESS;
   } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
-
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
+/*
+Read an id from the first length characters of string. Like atoi(),
+digits are read up to the first other character, but an id that does
+not fit in 32 bits is an error rather than a wrapped number.
+*/
+PrepareResult parse_id(const char* string, uint32_t length, int64_t* id) {
+  bool negative = (string[0] == '-');
+  *id = 0;
+  for (uint32_t i = negative ? 1 : 0;
+       i < length && string[i] >= '0' && string[i] <= '9'; i++) {
+    *id = *id * 10 + (string[i] - '0');
+    if (*id > UINT32_MAX) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (negative && *id != 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  return PREPARE_SUCCESS;
+}
 
+PrepareResult prepare_row(char* id_string, char* username, char* email,
+                          Row* row) {
   if (id_string == NULL || username == NULL || email == NULL) {
     return PREPARE_SYNTAX_ERROR;
   }
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+  int64_t id;
+  PrepareResult result = parse_id(id_string, strlen(id_string), &id);
+  if (result != PREPARE_SUCCESS) {
+    return result;
   }
   if (strlen(username) > COLUMN_USERNAME_SIZE) {
     return PREPARE_STRING_TOO_LONG;
@@ -621,224 +405,370 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
     return PREPARE_STRING_TOO_LONG;
   }
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+  row->id = id;
+  strcpy(row->username, username);
+  strcpy(row->email, email);
 
   return PREPARE_SUCCESS;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer,
-                                Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+/*
+Find the next space-separated field of the line, leaving it in place,
+and move *line past it. Returns the field's length, 0 at the end.
+*/
+uint32_t next_field(char** line, char** field) {
+  char* end = *line;
+  while (*end == ' ') {
+    end++;
   }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  *field = end;
+  while (*end != ' ' && *end != '\0') {
+    end++;
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  *line = end;
+  return end - *field;
 }
 
-/*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
-*/
-uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
-
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  /*
-  Handle splitting the root.
-  Old root copied to new page, becomes left child.
-  Address of right child passed in.
-  Re-initialize root page to contain the new root node.
-  New root node points to two children.
-  */
-
-  void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
-
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
-
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
-}
-
-void internal_node_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
   /*
-  Add a new child/key pair to parent that corresponds to child
+  The strings are bound where they are in the input line, which is
+  not read over until the statement has run.
   */
+  statement->type = STATEMENT_INSERT;
 
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
+  char* line = input_buffer->buffer;
+  char* keyword;
+  char* id_string;
+  char* username;
+  char* email;
+  next_field(&line, &keyword);
+  uint32_t id_length = next_field(&line, &id_string);
+  uint32_t username_length = next_field(&line, &username);
+  uint32_t email_length = next_field(&line, &email);
+  if (id_length == 0 || username_length == 0 || email_length == 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
 
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+  int64_t id;
+  PrepareResult result = parse_id(id_string, id_length, &id);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+  db_bind_id(statement->insert, id);
+  if (db_bind_text(statement->insert, DB_COLUMN_USERNAME, username,
+                   username_length) != DB_SUCCESS ||
+      db_bind_text(statement->insert, DB_COLUMN_EMAIL, email, email_length) !=
+          DB_SUCCESS) {
+    return PREPARE_STRING_TOO_LONG;
   }
+  return PREPARE_SUCCESS;
+}
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void* right_child = get_page(table->pager, right_child_page_num);
+/* Narrow [first_id, last_id] by the predicate id <op> value */
+PrepareResult prepare_id_predicate(char* op, char* value_string,
+                                   int64_t* first_id, int64_t* last_id) {
+  int64_t value;
+  PrepareResult result = parse_id(value_string, strlen(value_string), &value);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
 
-  if (child_max_key > get_node_max_key(right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+  /* The predicate alone allows [lower, upper] */
+  int64_t lower = 0;
+  int64_t upper = UINT32_MAX;
+  if (strcmp(op, "between") == 0) {
+    char* and = strtok(NULL, " ");
+    char* upper_string = strtok(NULL, " ");
+    if (and == NULL || strcmp(and, "and") != 0 || upper_string == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    lower = value;
+    result = parse_id(upper_string, strlen(upper_string), &upper);
+    if (result != PREPARE_SUCCESS) {
+      return result;
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+  } else if (strcmp(op, "=") == 0) {
+    lower = value;
+    upper = value;
+  } else if (strcmp(op, ">=") == 0) {
+    lower = value;
+  } else if (strcmp(op, ">") == 0) {
+    lower = value + 1;
+  } else if (strcmp(op, "<=") == 0) {
+    upper = value;
+  } else if (strcmp(op, "<") == 0) {
+    upper = value - 1;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
   }
+  if (lower > *first_id) {
+    *first_id = lower;
+  }
+  if (upper < *last_id) {
+    *last_id = upper;
+  }
+  return PREPARE_SUCCESS;
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
-}
-
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+PrepareResult prepare_where(char* where, Statement* statement) {
   /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent.
+  Turn an optional where clause into the range [first_id, last_id].
+  Supported forms:
+    where id <op> n [and id <op> n]   (op is =, <, <=, > or >=)
+    where id between a and b          (both ends included)
+  One predicate may instead be username = s or email = s, which also
+  sets has_value.
   */
+  int64_t first_id = 0;
+  int64_t last_id = UINT32_MAX;
+  statement->has_value = false;
 
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
+  if (where != NULL) {
+    if (strcmp(where, "where") != 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
 
-  /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
-    } else {
-      destination_node = old_node;
+    char* column = strtok(NULL, " ");
+    if (column == NULL) {
+      return PREPARE_SYNTAX_ERROR;
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
-
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+    while (column != NULL) {
+      char* op = strtok(NULL, " ");
+      char* value_string = strtok(NULL, " ");
+      if (op == NULL || value_string == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+
+      if (strcmp(column, "username") == 0 || strcmp(column, "email") == 0) {
+        if (statement->has_value || strcmp(op, "=") != 0) {
+          return PREPARE_SYNTAX_ERROR;
+        }
+        statement->column = strcmp(column, "username") == 0
+                                ? DB_COLUMN_USERNAME
+                                : DB_COLUMN_EMAIL;
+        size_t max_length = statement->column == DB_COLUMN_USERNAME
+                                ? COLUMN_USERNAME_SIZE
+                                : COLUMN_EMAIL_SIZE;
+        if (strlen(value_string) > max_length) {
+          return PREPARE_STRING_TOO_LONG;
+        }
+        strcpy(statement->value, value_string);
+        statement->has_value = true;
+      } else if (strcmp(column, "id") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+      } else {
+        PrepareResult result =
+            prepare_id_predicate(op, value_string, &first_id, &last_id);
+        if (result != PREPARE_SUCCESS) {
+          return result;
+        }
+      }
+
+      char* and = strtok(NULL, " ");
+      if (and == NULL) {
+        break;
+      }
+      if (strcmp(and, "and") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      column = strtok(NULL, " ");
+      if (column == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+      }
     }
   }
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  if (first_id > last_id) {
+    /* Nothing can match. An inverted range makes the cursor empty. */
+    first_id = 1;
+    last_id = 0;
+  }
+  statement->first_id = first_id;
+  statement->last_id = last_id;
+  return PREPARE_SUCCESS;
+}
 
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
-  }
+  strtok(input_buffer->buffer, " ");
+  char* where = strtok(NULL, " ");
+  return prepare_where(where, statement);
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_DELETE;
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
+  strtok(input_buffer->buffer, " ");
+  char* where = strtok(NULL, " ");
+  if (where == NULL) {
+    /* Emptying the whole table takes an explicit range */
+    return PREPARE_SYNTAX_ERROR;
   }
+  return prepare_where(where, statement);
+}
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    }
+PrepareResult prepare_create_index(InputBuffer* input_buffer,
+                                   Statement* statement) {
+  statement->type = STATEMENT_CREATE_INDEX;
+  if (strcmp(input_buffer->buffer, "create index on users(username)") == 0) {
+    statement->column = DB_COLUMN_USERNAME;
+  } else if (strcmp(input_buffer->buffer, "create index on users(email)") ==
+             0) {
+    statement->column = DB_COLUMN_EMAIL;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
   }
-
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  return PREPARE_SUCCESS;
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor* cursor = table_find(table, key_to_insert);
+PrepareResult prepare_statement(InputBuffer* input_buffer,
+                                Statement* statement) {
+  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+    return prepare_insert(input_buffer, statement);
+  }
+  if (strcmp(input_buffer->buffer, "select") == 0 ||
+      strncmp(input_buffer->buffer, "select ", 7) == 0) {
+    return prepare_select(input_buffer, statement);
+  }
+  if (strncmp(input_buffer->buffer, "delete ", 7) == 0 ||
+      strcmp(input_buffer->buffer, "delete") == 0) {
+    return prepare_delete(input_buffer, statement);
+  }
+  if (strncmp(input_buffer->buffer, "create ", 7) == 0) {
+    return prepare_create_index(input_buffer, statement);
+  }
+  if (strcmp(input_buffer->buffer, "begin") == 0) {
+    statement->type = STATEMENT_BEGIN;
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(input_buffer->buffer, "commit") == 0) {
+    statement->type = STATEMENT_COMMIT;
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(input_buffer->buffer, "rollback") == 0) {
+    statement->type = STATEMENT_ROLLBACK;
+    return PREPARE_SUCCESS;
+  }
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  switch (db_step(statement->insert)) {
+    case (DB_DUPLICATE_KEY):
       return EXECUTE_DUPLICATE_KEY;
+    default:
+      return EXECUTE_SUCCESS;
+  }
+}
+
+/*
+The rows in the statement's id range whose column equals its value,
+found through the column's index if there is one. The caller frees
+*rows.
+*/
+uint32_t find_rows(Statement* statement, Table* table, Row** rows) {
+  uint32_t capacity = 16;
+  *rows = malloc(capacity * sizeof(Row));
+  uint32_t num_rows =
+      db_find(table, statement->column, statement->value, *rows, capacity);
+  if (num_rows > capacity) {
+    capacity = num_rows;
+    *rows = realloc(*rows, capacity * sizeof(Row));
+    num_rows =
+        db_find(table, statement->column, statement->value, *rows, capacity);
+    if (num_rows > capacity) {
+      num_rows = capacity;
     }
   }
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+  uint32_t num_in_range = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if ((*rows)[i].id >= statement->first_id &&
+        (*rows)[i].id <= statement->last_id) {
+      (*rows)[num_in_range++] = (*rows)[i];
+    }
+  }
+  return num_in_range;
+}
 
-  free(cursor);
+ExecuteResult execute_select(Statement* statement, Table* table) {
+  Output* output = statement->output;
+  output_begin(output);
+  if (statement->has_value) {
+    Row* rows;
+    uint32_t num_rows = find_rows(statement, table, &rows);
+    for (uint32_t i = 0; i < num_rows; i++) {
+      RowFields fields = {rows[i].id, rows[i].username,
+                          strlen(rows[i].username), rows[i].email,
+                          strlen(rows[i].email)};
+      output_row(&fields, output);
+    }
+    free(rows);
+  } else {
+    /* Rows are formatted straight from their leaves */
+    Cursor* cursor =
+        db_cursor_open_range(table, statement->first_id, statement->last_id);
+    db_cursor_visit(cursor, output_row, output);
+    db_cursor_close(cursor);
+  }
+  output_end(output);
 
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+  uint32_t num_deleted = 0;
+  if (statement->has_value) {
+    Row* rows;
+    uint32_t num_rows = find_rows(statement, table, &rows);
+    for (uint32_t i = 0; i < num_rows; i++) {
+      if (db_delete(table, rows[i].id) == DB_SUCCESS) {
+        num_deleted++;
+      }
+    }
+    free(rows);
+  } else {
+    num_deleted =
+        db_delete_range(table, statement->first_id, statement->last_id);
+  }
+  printf("Deleted %d rows.\n", num_deleted);
+  return EXECUTE_SUCCESS;
+}
 
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+ExecuteResult execute_transaction(Statement* statement, Table* table) {
+  DbResult result;
+  switch (statement->type) {
+    case (STATEMENT_BEGIN):
+      result = db_begin(table);
+      break;
+    case (STATEMENT_COMMIT):
+      result = db_commit(table);
+      break;
+    default:
+      result = db_rollback(table);
+      break;
   }
 
-  free(cursor);
+  switch (result) {
+    case (DB_TRANSACTION_OPEN):
+      return EXECUTE_TRANSACTION_OPEN;
+    case (DB_NO_TRANSACTION):
+      return EXECUTE_NO_TRANSACTION;
+    default:
+      return EXECUTE_SUCCESS;
+  }
+}
 
-  return EXECUTE_SUCCESS;
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+  switch (db_create_index(table, statement->column)) {
+    case (DB_INDEX_EXISTS):
+      return EXECUTE_INDEX_EXISTS;
+    default:
+      return EXECUTE_SUCCESS;
+  }
 }
 
 ExecuteResult execute_statement(Statement* statement, Table* table) {
@@ -847,25 +777,154 @@ ExecuteResult execute_statement(Statement* statement, Table* table) {
       return execute_insert(statement, table);
     case (STATEMENT_SELECT):
       return execute_select(statement, table);
+    case (STATEMENT_DELETE):
+      return execute_delete(statement, table);
+    case (STATEMENT_BEGIN):
+    case (STATEMENT_COMMIT):
+    case (STATEMENT_ROLLBACK):
+      return execute_transaction(statement, table);
+    case (STATEMENT_CREATE_INDEX):
+      return execute_create_index(statement, table);
   }
 }
 
+#define BULK_LOAD_BATCH_ROWS 4096
+
+int compare_rows_by_id(const void* a, const void* b) {
+  uint32_t id_a = ((const Row*)a)->id;
+  uint32_t id_b = ((const Row*)b)->id;
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+void bulk_load(Table* table, const char* filename, uint32_t fill_factor) {
+  /*
+  Rows are read in batches and sorted, so input only has to be
+  sorted locally. Rows that still arrive behind the last loaded key
+  are inserted the normal way once the tree is built.
+  */
+  FILE* file = fopen(filename, "r");
+  if (file == NULL) {
+    printf("Unable to open file '%s'\n", filename);
+    return;
+  }
+
+  if (db_has_index(table, DB_COLUMN_USERNAME) ||
+      db_has_index(table, DB_COLUMN_EMAIL)) {
+    printf("Bulk load requires a table without indexes.\n");
+    fclose(file);
+    return;
+  }
+
+  BulkLoader* loader = db_bulk_load_begin(table, fill_factor);
+  if (loader == NULL) {
+    printf("Bulk load requires an empty table.\n");
+    fclose(file);
+    return;
+  }
+
+  Row* batch = malloc(BULK_LOAD_BATCH_ROWS * sizeof(Row));
+  Row* stragglers = NULL;
+  uint32_t num_stragglers = 0;
+  uint32_t stragglers_capacity = 0;
+  char* line = NULL;
+  size_t line_capacity = 0;
+  uint32_t line_num = 0;
+  bool end_of_file = false;
+
+  while (!end_of_file) {
+    uint32_t batch_size = 0;
+    while (batch_size < BULK_LOAD_BATCH_ROWS) {
+      if (getline(&line, &line_capacity, file) == -1) {
+        end_of_file = true;
+        break;
+      }
+      line_num++;
+
+      char* id_string = strtok(line, " \t\r\n");
+      if (id_string == NULL) {
+        continue;
+      }
+      char* username = strtok(NULL, " \t\r\n");
+      char* email = strtok(NULL, " \t\r\n");
+      if (prepare_row(id_string, username, email, &batch[batch_size]) !=
+          PREPARE_SUCCESS) {
+        printf("Skipping invalid row on line %d.\n", line_num);
+        continue;
+      }
+      batch_size++;
+    }
+
+    qsort(batch, batch_size, sizeof(Row), compare_rows_by_id);
+    for (uint32_t i = 0; i < batch_size; i++) {
+      if (db_bulk_load_append(loader, &batch[i]) == DB_OUT_OF_ORDER) {
+        if (num_stragglers == stragglers_capacity) {
+          stragglers_capacity = stragglers_capacity ? stragglers_capacity * 2
+                                                    : BULK_LOAD_BATCH_ROWS;
+          stragglers = realloc(stragglers, stragglers_capacity * sizeof(Row));
+        }
+        stragglers[num_stragglers++] = batch[i];
+      }
+    }
+  }
+
+  uint32_t num_rows = db_bulk_load_finish(loader);
+
+  uint32_t num_duplicates = 0;
+  for (uint32_t i = 0; i < num_stragglers; i++) {
+    if (db_insert(table, &stragglers[i]) == DB_DUPLICATE_KEY) {
+      num_duplicates++;
+    }
+  }
+
+  printf("Loaded %d rows.\n", num_rows + num_stragglers - num_duplicates);
+  if (num_duplicates > 0) {
+    printf("Skipped %d duplicate keys.\n", num_duplicates);
+  }
+
+  free(line);
+  free(stragglers);
+  free(batch);
+  fclose(file);
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  char* filename = NULL;
+  DbOptions options = default_db_options();
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--cache-pages=", 14) == 0) {
+      options.cache_pages = atoi(argv[i] + 14);
+    } else if (strncmp(argv[i], "--commit-interval-ms=", 21) == 0) {
+      options.commit_interval_ms = atoi(argv[i] + 21);
+    } else if (strcmp(argv[i], "--async-commit") == 0) {
+      options.async_commit = true;
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    } else if (strncmp(argv[i], "--readahead-pages=", 18) == 0) {
+      options.readahead_pages = atoi(argv[i] + 18);
+    } else if (strcmp(argv[i], "--compress-wal") == 0) {
+      options.compress_wal = true;
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL) {
     printf("Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
 
-  char* filename = argv[1];
-  Table* table = db_open(filename);
+  Table* table = db_open(filename, &options);
 
+  DbStatement* insert = db_prepare_insert(table);
+  Output* output = new_output();
   InputBuffer* input_buffer = new_input_buffer();
   while (true) {
     print_prompt();
     read_input(input_buffer);
 
     if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
+      switch (do_meta_command(input_buffer, table, output)) {
         case (META_COMMAND_SUCCESS):
           continue;
         case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -875,6 +934,8 @@ int main(int argc, char* argv[]) {
     }
 
     Statement statement;
+    statement.insert = insert;
+    statement.output = output;
     switch (prepare_statement(input_buffer, &statement)) {
       case (PREPARE_SUCCESS):
         break;
@@ -900,6 +961,15 @@ int main(int argc, char* argv[]) {
       case (EXECUTE_DUPLICATE_KEY):
         printf("Error: Duplicate key.\n");
         break;
+      case (EXECUTE_TRANSACTION_OPEN):
+        printf("Error: Transaction already open.\n");
+        break;
+      case (EXECUTE_NO_TRANSACTION):
+        printf("Error: No transaction is open.\n");
+        break;
+      case (EXECUTE_INDEX_EXISTS):
+        printf("Error: Index already exists.\n");
+        break;
     }
   }
 }
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+const char* row_column(const Row* row, DbColumn column) {
+  return column == DB_COLUMN_USERNAME ? row->username : row->email;
+}
+
+/* Copy the column's value out of fields, terminated, into value */
+void row_fields_column(const RowFields* fields, DbColumn column, char* value) {
+  const char* source =
+      column == DB_COLUMN_USERNAME ? fields->username : fields->email;
+  uint32_t size = column == DB_COLUMN_USERNAME ? fields->username_size
+                                               : fields->email_size;
+  memcpy(value, source, size);
+  value[size] = '\0';
+}
+
+/* FNV-1a */
+uint32_t index_hash(const char* value) {
+  uint32_t hash = 2166136261u;
+  for (const uint8_t* byte = (const uint8_t*)value; *byte != '\0'; byte++) {
+    hash = (hash ^ *byte) * 16777619u;
+  }
+  return hash;
+}
+
+uint64_t index_key(uint32_t hash, uint32_t id) {
+  return (uint64_t)hash << 32 | id;
+}
+
+Table* index_open(Table* table, DbColumn column, uint32_t root_page_num) {
+  Table* index = malloc(sizeof(Table));
+  index->pager = table->pager;
+  index->root_page_num = root_page_num;
+  index->is_index = true;
+  index->indexed_column = column;
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    index->indexes[i] = NULL;
+  }
+  index->in_transaction = false;
+  index->num_latched_pages = 0;
+  index->append_leaf = INVALID_PAGE_NUM;
+  index->spare_cursor = NULL;
+  return index;
+}
+
+/* The entry's fields point into hash and value */
+void index_entry(const uint32_t* hash, const char* value, uint32_t id,
+                 RowFields* entry) {
+  entry->id = id;
+  entry->username = (const char*)hash;
+  entry->username_size = sizeof(uint32_t);
+  entry->email = value;
+  entry->email_size = strlen(value);
+}
+
+void index_insert(Table* index, const char* value, uint32_t id) {
+  uint32_t hash = index_hash(value);
+  uint64_t key = index_key(hash, id);
+  RowFields entry;
+  index_entry(&hash, value, id, &entry);
+  Cursor cursor;
+  table_find_for_write(&cursor, index, key, true);
+  leaf_node_insert(&cursor, key, &entry);
+  cursor_close(&cursor);
+}
+
+void index_delete(Table* index, const char* value, uint32_t id) {
+  table_delete(index, index_key(index_hash(value), id));
+}
+
+/*
+Collect the ids of the rows whose column equals value, in id order,
+into *ids, which is grown with realloc() and must be freed by the
+caller. Returns false if there is no index to look in, which at a
+snapshot can also be one created since.
+*/
+bool index_lookup(Table* index, const char* value, bool snapshot,
+                  uint32_t** ids, uint32_t* num_ids) {
+  *ids = NULL;
+  *num_ids = 0;
+  if (table_root(index) == 0) {
+    return false;
+  }
+  uint32_t hash = index_hash(value);
+  Cursor cursor;
+  if (snapshot) {
+    if (!table_seek_snapshot(&cursor, index, index_key(hash, 0))) {
+      return false;
+    }
+  } else {
+    table_seek(&cursor, index, index_key(hash, 0));
+  }
+  cursor_set_last_key(&cursor, index_key(hash, UINT32_MAX));
+
+  uint32_t value_size = strlen(value);
+  uint32_t ids_capacity = 0;
+  RowFields entry;
+  while (!cursor.end_of_table) {
+    deserialize_row_fields(cursor_value(&cursor), &entry);
+    if (entry.email_size == value_size &&
+        memcmp(entry.email, value, value_size) == 0) {
+      if (*num_ids == ids_capacity) {
+        ids_capacity = ids_capacity ? ids_capacity * 2 : 16;
+        *ids = realloc(*ids, ids_capacity * sizeof(uint32_t));
+      }
+      (*ids)[(*num_ids)++] = entry.id;
+    }
+    cursor_advance(&cursor);
+  }
+  cursor_close(&cursor);
+  return true;
+}
+
+typedef struct {
+  uint32_t hash;
+  uint32_t id;
+  uint32_t value_offset;  // into the build's value buffer
+} IndexBuildEntry;
+
+int compare_build_entries(const void* a, const void* b) {
+  const IndexBuildEntry* x = a;
+  const IndexBuildEntry* y = b;
+  if (x->hash != y->hash) {
+    return (x->hash > y->hash) - (x->hash < y->hash);
+  }
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+void index_build(Table* table, Table* index) {
+  /*
+  Index every row of the table. The entries are sorted by key and
+  bulk loaded into a tree of their own, which only replaces the
+  index's empty root once it is complete, so readers never see it
+  half built.
+  */
+  DbColumn column = index->indexed_column;
+  IndexBuildEntry* entries = NULL;
+  uint32_t num_entries = 0;
+  uint32_t entries_capacity = 0;
+  char* values = NULL;
+  uint32_t values_length = 0;
+  uint32_t values_capacity = 0;
+
+  Cursor cursor;
+  table_start(&cursor, table);
+  Row row;
+  while (!cursor.end_of_table) {
+    deserialize_row(cursor_value(&cursor), &row);
+    const char* value = row_column(&row, column);
+    uint32_t value_size = strlen(value) + 1;
+    if (num_entries == entries_capacity) {
+      entries_capacity = entries_capacity ? entries_capacity * 2 : 1024;
+      entries = realloc(entries, entries_capacity * sizeof(IndexBuildEntry));
+    }
+    while (values_length + value_size > values_capacity) {
+      values_capacity = values_capacity ? values_capacity * 2 : 16384;
+      values = realloc(values, values_capacity);
+    }
+    IndexBuildEntry* entry = &entries[num_entries++];
+    entry->hash = index_hash(value);
+    entry->id = row.id;
+    entry->value_offset = values_length;
+    memcpy(values + values_length, value, value_size);
+    values_length += value_size;
+    cursor_advance(&cursor);
+  }
+  cursor_close(&cursor);
+
+  qsort(entries, num_entries, sizeof(IndexBuildEntry), compare_build_entries);
+  Table* build = index_open(table, column, 0);
+  table_create_root(build);
+  BulkLoader loader;
+  bulk_load_init(&loader, build, 100);
+  for (uint32_t i = 0; i < num_entries; i++) {
+    RowFields entry;
+    index_entry(&entries[i].hash, values + entries[i].value_offset,
+                entries[i].id, &entry);
+    bulk_load_append_fields(&loader, &entry);
+  }
+  bulk_load_finish(&loader);
+  __atomic_store_n(&index->root_page_num, build->root_page_num,
+                   __ATOMIC_RELEASE);
+  free(build);
+
+  free(values);
+  free(entries);
+}
@@ -0,0 +1,30 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "btree.h"
+
+/*
+ * Secondary indexes. An index is a B-tree like the table's, and every
+ * entry in it is stored as a row: the indexed row's id in the id, the
+ * indexed value's 32-bit hash, in binary, in the username, and the
+ * value itself in the email.
+ *
+ * An entry's key is the hash in the high 32 bits and the id in the
+ * low ones, so every key is unique however many rows share a value.
+ * All entries for one hash sit in one run of keys, in id order, so a
+ * lookup is a range scan, and the values stored in the entries tell
+ * apart values whose hashes collide.
+ */
+const char* row_column(const Row* row, DbColumn column);
+void row_fields_column(const RowFields* fields, DbColumn column, char* value);
+Table* index_open(Table* table, DbColumn column, uint32_t root_page_num);
+void index_insert(Table* index, const char* value, uint32_t id);
+void index_delete(Table* index, const char* value, uint32_t id);
+bool index_lookup(Table* index, const char* value, bool snapshot,
+                  uint32_t** ids, uint32_t* num_ids);
+void index_build(Table* table, Table* index);
+
+#endif
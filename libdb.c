@@ -0,0 +1,552 @@
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+DbOptions default_db_options() {
+  DbOptions options;
+  options.cache_pages = PAGER_DEFAULT_CACHE_PAGES;
+  options.commit_interval_ms = 0;
+  options.async_commit = false;
+  options.use_mmap = false;
+  options.readahead_pages = PAGER_DEFAULT_READAHEAD_PAGES;
+  options.compress_wal = false;
+  return options;
+}
+
+Table* db_open(const char* filename, DbOptions* options) {
+  Pager* pager = pager_open(filename, options);
+
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  pthread_mutexattr_t mutex_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&table->write_mutex, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  /* Readers come and go all the time, and must not hold off db_begin() */
+  pthread_rwlockattr_t lock_attr;
+  pthread_rwlockattr_init(&lock_attr);
+  pthread_rwlockattr_setkind_np(&lock_attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&table->transaction_lock, &lock_attr);
+  pthread_rwlockattr_destroy(&lock_attr);
+  table->in_transaction = false;
+  table->num_latched_pages = 0;
+  table->is_index = false;
+  table->append_leaf = INVALID_PAGE_NUM;
+  table->spare_cursor = NULL;
+
+  FileHeader* header = get_page(pager, HEADER_PAGE_NUM);
+  table->root_page_num = header->root_page_num;
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    table->indexes[i] =
+        index_open(table, (DbColumn)i, header->index_root_page_nums[i]);
+  }
+  unpin_page(pager, HEADER_PAGE_NUM, false);
+
+  if (table->root_page_num == 0) {
+    // New database file. The tree starts out as a single leaf.
+    table_create_root(table);
+    pager_commit(pager);
+  }
+
+  return table;
+}
+
+void db_close(Table* table) {
+  if (table->in_transaction) {
+    db_rollback(table);
+  }
+  pager_close(table->pager);
+  pthread_mutex_destroy(&table->write_mutex);
+  pthread_rwlock_destroy(&table->transaction_lock);
+  free(table->spare_cursor);
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    free(table->indexes[i]);
+  }
+  free(table);
+}
+
+bool db_owns_transaction(Table* table) {
+  return __atomic_load_n(&table->in_transaction, __ATOMIC_ACQUIRE) &&
+         pthread_equal(
+             __atomic_load_n(&table->transaction_owner, __ATOMIC_RELAXED),
+             pthread_self());
+}
+
+/* Other threads must not see the open transaction's changes */
+bool db_reads_snapshot(Table* table) {
+  return __atomic_load_n(&table->in_transaction, __ATOMIC_ACQUIRE) &&
+         !db_owns_transaction(table);
+}
+
+/*
+Start a read, and return whether it must be at a snapshot. The answer
+holds until db_read_end(), since no transaction can open meanwhile.
+A read must not start another before it ends.
+*/
+bool db_read_begin(Table* table) {
+  pthread_rwlock_rdlock(&table->transaction_lock);
+  return db_reads_snapshot(table);
+}
+
+void db_read_end(Table* table) {
+  pthread_rwlock_unlock(&table->transaction_lock);
+}
+
+/*
+The latches go before the commit, so readers never wait for the
+WAL to reach the disk. The wait for the sync comes after write_mutex,
+so that the next writers can commit into the same sync meanwhile.
+Inside a transaction the commit waits for db_commit().
+*/
+void db_end_write(Table* table) {
+  table_unlatch_all(table);
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    table_unlatch_all(table->indexes[i]);
+  }
+  Snapshot position = 0;
+  if (!table->in_transaction) {
+    position = pager_commit(table->pager);
+  }
+  pthread_mutex_unlock(&table->write_mutex);
+  pager_wait_synced(table->pager, position);
+}
+
+DbResult db_begin(Table* table) {
+  /* Held until db_commit() or db_rollback() */
+  pthread_mutex_lock(&table->write_mutex);
+  if (table->in_transaction) {
+    pthread_mutex_unlock(&table->write_mutex);
+    return DB_TRANSACTION_OPEN;
+  }
+  /* Waits out the reads that are using the buffer pool */
+  pthread_rwlock_wrlock(&table->transaction_lock);
+  __atomic_store_n(&table->transaction_owner, pthread_self(),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&table->in_transaction, true, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&table->transaction_lock);
+  return DB_SUCCESS;
+}
+
+DbResult db_commit(Table* table) {
+  if (!db_owns_transaction(table)) {
+    return DB_NO_TRANSACTION;
+  }
+  uint64_t start_ns = stats_now_ns();
+  __atomic_store_n(&table->in_transaction, false, __ATOMIC_RELEASE);
+  Snapshot position = pager_commit(table->pager);
+  pthread_mutex_unlock(&table->write_mutex);
+  pager_wait_synced(table->pager, position);
+  stats_record_latency(table->pager->counters, DB_OP_COMMIT, start_ns);
+  return DB_SUCCESS;
+}
+
+DbResult db_rollback(Table* table) {
+  if (!db_owns_transaction(table)) {
+    return DB_NO_TRANSACTION;
+  }
+  pager_rollback(table->pager);
+  table->append_leaf = INVALID_PAGE_NUM;
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    table->indexes[i]->append_leaf = INVALID_PAGE_NUM;
+  }
+
+  /* The header page was dropped with the rest, so the roots may move back */
+  FileHeader* header = get_page(table->pager, HEADER_PAGE_NUM);
+  __atomic_store_n(&table->root_page_num, header->root_page_num,
+                   __ATOMIC_RELEASE);
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    __atomic_store_n(&table->indexes[i]->root_page_num,
+                     header->index_root_page_nums[i], __ATOMIC_RELEASE);
+  }
+  unpin_page(table->pager, HEADER_PAGE_NUM, false);
+
+  /* Readers go back to the buffer pool only once it is clean */
+  __atomic_store_n(&table->in_transaction, false, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&table->write_mutex);
+  return DB_SUCCESS;
+}
+
+bool db_has_indexes(Table* table) {
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i]->root_page_num != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+DbResult db_insert_fields(Table* table, const RowFields* fields) {
+  pthread_mutex_lock(&table->write_mutex);
+
+  Cursor cursor;
+  table_find_for_write(&cursor, table, fields->id, true);
+
+  void* node = get_page(table->pager, cursor.page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  bool duplicate_key = false;
+  if (cursor.cell_num < num_cells) {
+    uint32_t key_at_index = *leaf_node_key(node, cursor.cell_num);
+    duplicate_key = (key_at_index == fields->id);
+  }
+  unpin_page(table->pager, cursor.page_num, false);
+
+  if (duplicate_key) {
+    cursor_close(&cursor);
+    db_end_write(table);
+    return DB_DUPLICATE_KEY;
+  }
+
+  leaf_node_insert(&cursor, fields->id, fields);
+  cursor_close(&cursor);
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    Table* index = table->indexes[i];
+    if (index->root_page_num != 0) {
+      char value[COLUMN_EMAIL_SIZE + 1];
+      row_fields_column(fields, i, value);
+      index_insert(index, value, fields->id);
+    }
+  }
+
+  /* Every change is its own transaction */
+  db_end_write(table);
+  return DB_SUCCESS;
+}
+
+DbResult db_insert(Table* table, const Row* row) {
+  uint64_t start_ns = stats_now_ns();
+  RowFields fields;
+  row_fields(row, &fields);
+  DbResult result = db_insert_fields(table, &fields);
+  stats_record_latency(table->pager->counters, DB_OP_INSERT, start_ns);
+  return result;
+}
+
+DbStatement* db_prepare_insert(Table* table) {
+  DbStatement* statement = malloc(sizeof(DbStatement));
+  statement->table = table;
+  statement->fields.id = 0;
+  statement->fields.username = "";
+  statement->fields.username_size = 0;
+  statement->fields.email = "";
+  statement->fields.email_size = 0;
+  return statement;
+}
+
+void db_bind_id(DbStatement* statement, uint32_t id) {
+  statement->fields.id = id;
+}
+
+DbResult db_bind_text(DbStatement* statement, DbColumn column,
+                      const char* value, uint32_t length) {
+  if (column == DB_COLUMN_USERNAME) {
+    if (length > COLUMN_USERNAME_SIZE) {
+      return DB_STRING_TOO_LONG;
+    }
+    statement->fields.username = value;
+    statement->fields.username_size = length;
+  } else {
+    if (length > COLUMN_EMAIL_SIZE) {
+      return DB_STRING_TOO_LONG;
+    }
+    statement->fields.email = value;
+    statement->fields.email_size = length;
+  }
+  return DB_SUCCESS;
+}
+
+DbResult db_step(DbStatement* statement) {
+  uint64_t start_ns = stats_now_ns();
+  Table* table = statement->table;
+  DbResult result = db_insert_fields(table, &statement->fields);
+  stats_record_latency(table->pager->counters, DB_OP_INSERT, start_ns);
+  return result;
+}
+
+void db_finalize(DbStatement* statement) { free(statement); }
+
+DbResult db_get_latched(Table* table, uint32_t id, Row* row) {
+  Cursor cursor;
+  table_find(&cursor, table, id);
+
+  void* node = get_page(table->pager, cursor.page_num);
+  DbResult result = DB_KEY_NOT_FOUND;
+  if (cursor.cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor.cell_num) == id) {
+    deserialize_row(cursor_value(&cursor), row);
+    result = DB_SUCCESS;
+  }
+  unpin_page(table->pager, cursor.page_num, false);
+
+  cursor_close(&cursor);
+  return result;
+}
+
+DbResult db_get_row(Table* table, uint32_t id, Row* row) {
+  DbResult result = DB_KEY_NOT_FOUND;
+  if (db_read_begin(table)) {
+    Cursor cursor;
+    table_seek_snapshot(&cursor, table, id);
+    if (!cursor.end_of_table && cursor_key(&cursor) == id) {
+      deserialize_row(cursor_value(&cursor), row);
+      result = DB_SUCCESS;
+    }
+    cursor_close(&cursor);
+  } else {
+    result = db_get_latched(table, id, row);
+  }
+  db_read_end(table);
+  return result;
+}
+
+DbResult db_get(Table* table, uint32_t id, Row* row) {
+  uint64_t start_ns = stats_now_ns();
+  DbResult result = db_get_row(table, id, row);
+  stats_record_latency(table->pager->counters, DB_OP_GET, start_ns);
+  return result;
+}
+
+/* Delete a row and its index entries. The caller holds write_mutex. */
+bool db_delete_row(Table* table, uint32_t id) {
+  if (!db_has_indexes(table)) {
+    return table_delete(table, id);
+  }
+
+  Row row;
+  if (db_get_latched(table, id, &row) != DB_SUCCESS) {
+    return false;
+  }
+  table_delete(table, id);
+  for (uint32_t i = 0; i < DB_NUM_INDEXED_COLUMNS; i++) {
+    Table* index = table->indexes[i];
+    if (index->root_page_num != 0) {
+      index_delete(index, row_column(&row, i), id);
+    }
+  }
+  return true;
+}
+
+DbResult db_delete(Table* table, uint32_t id) {
+  uint64_t start_ns = stats_now_ns();
+  pthread_mutex_lock(&table->write_mutex);
+  bool found = db_delete_row(table, id);
+  db_end_write(table);
+  stats_record_latency(table->pager->counters, DB_OP_DELETE, start_ns);
+  return found ? DB_SUCCESS : DB_KEY_NOT_FOUND;
+}
+
+uint32_t db_delete_range(Table* table, uint32_t first_id, uint32_t last_id) {
+  /* Seek again after each delete, since rebalancing moves rows around */
+  uint64_t start_ns = stats_now_ns();
+  pthread_mutex_lock(&table->write_mutex);
+  uint32_t num_deleted = 0;
+  while (first_id <= last_id) {
+    Cursor cursor;
+    table_seek(&cursor, table, first_id);
+    cursor_set_last_key(&cursor, last_id);
+    bool end_of_range = cursor.end_of_table;
+    uint32_t key = end_of_range ? 0 : cursor_key(&cursor);
+    cursor_close(&cursor);
+    if (end_of_range) {
+      break;
+    }
+
+    db_delete_row(table, key);
+    num_deleted++;
+    if (key == last_id) {
+      break;
+    }
+    first_id = key + 1;
+  }
+
+  db_end_write(table);
+  stats_record_latency(table->pager->counters, DB_OP_DELETE_RANGE, start_ns);
+  return num_deleted;
+}
+
+Cursor* db_cursor_open(Table* table, uint32_t start_id) {
+  return db_cursor_open_range(table, start_id, UINT32_MAX);
+}
+
+void db_scan(Cursor* cursor, Table* table, uint32_t first_id,
+             uint32_t last_id) {
+  /* A snapshot would hide the thread's own uncommitted changes */
+  if (db_owns_transaction(table)) {
+    table_seek(cursor, table, first_id);
+  } else {
+    table_seek_snapshot(cursor, table, first_id);
+  }
+  cursor_set_last_key(cursor, last_id);
+}
+
+Cursor* db_cursor_open_range(Table* table, uint32_t first_id,
+                             uint32_t last_id) {
+  /* The table keeps the last cursor closed, to hand out again */
+  uint64_t start_ns = stats_now_ns();
+  Cursor* cursor =
+      __atomic_exchange_n(&table->spare_cursor, NULL, __ATOMIC_ACQUIRE);
+  if (cursor == NULL) {
+    cursor = malloc(sizeof(Cursor));
+  }
+  db_scan(cursor, table, first_id, last_id);
+  cursor->opened_ns = start_ns;
+  return cursor;
+}
+
+bool db_cursor_next(Cursor* cursor, Row* row) {
+  if (cursor->end_of_table) {
+    return false;
+  }
+  deserialize_row(cursor_value(cursor), row);
+  cursor_advance(cursor);
+  return true;
+}
+
+void db_cursor_close(Cursor* cursor) {
+  Table* table = cursor->table;
+  cursor_close(cursor);
+  stats_record_latency(table->pager->counters, DB_OP_SCAN,
+                       cursor->opened_ns);
+  free(__atomic_exchange_n(&table->spare_cursor, cursor, __ATOMIC_RELEASE));
+}
+
+void db_cursor_visit(Cursor* cursor, DbRowVisitor visitor, void* context) {
+  RowFields fields;
+  while (!cursor->end_of_table) {
+    deserialize_row_fields(cursor_value(cursor), &fields);
+    if (!visitor(&fields, context)) {
+      return;
+    }
+    cursor_advance(cursor);
+  }
+}
+
+DbResult db_create_index(Table* table, DbColumn column) {
+  pthread_mutex_lock(&table->write_mutex);
+  DbResult result = DB_SUCCESS;
+  if (table->indexes[column]->root_page_num != 0) {
+    result = DB_INDEX_EXISTS;
+  } else {
+    index_build(table, table->indexes[column]);
+  }
+  db_end_write(table);
+  return result;
+}
+
+bool db_has_index(Table* table, DbColumn column) {
+  return table_root(table->indexes[column]) != 0;
+}
+
+uint32_t db_find(Table* table, DbColumn column, const char* value, Row* rows,
+                 uint32_t max_rows) {
+  uint64_t start_ns = stats_now_ns();
+  uint32_t num_found = 0;
+  Row row;
+  uint32_t* ids;
+  uint32_t num_ids;
+  bool snapshot = db_read_begin(table);
+  bool indexed =
+      index_lookup(table->indexes[column], value, snapshot, &ids, &num_ids);
+  db_read_end(table);
+  if (indexed) {
+    /* The row is checked again, since it may have changed since */
+    for (uint32_t i = 0; i < num_ids; i++) {
+      if (db_get_row(table, ids[i], &row) == DB_SUCCESS &&
+          strcmp(row_column(&row, column), value) == 0) {
+        if (num_found < max_rows) {
+          rows[num_found] = row;
+        }
+        num_found++;
+      }
+    }
+    free(ids);
+  } else {
+    Cursor cursor;
+    db_scan(&cursor, table, 0, UINT32_MAX);
+    while (db_cursor_next(&cursor, &row)) {
+      if (strcmp(row_column(&row, column), value) == 0) {
+        if (num_found < max_rows) {
+          rows[num_found] = row;
+        }
+        num_found++;
+      }
+    }
+    cursor_close(&cursor);
+  }
+  stats_record_latency(table->pager->counters, DB_OP_FIND, start_ns);
+  return num_found;
+}
+
+BulkLoader* db_bulk_load_begin(Table* table, uint32_t fill_factor) {
+  /* Held until db_bulk_load_finish() */
+  pthread_mutex_lock(&table->write_mutex);
+  if (!table_is_empty(table) || db_has_indexes(table)) {
+    pthread_mutex_unlock(&table->write_mutex);
+    return NULL;
+  }
+
+  BulkLoader* loader = malloc(sizeof(BulkLoader));
+  bulk_load_init(loader, table, fill_factor);
+  return loader;
+}
+
+DbResult db_bulk_load_append(BulkLoader* loader, const Row* row) {
+  if (loader->num_rows > 0 && row->id <= loader->last_key) {
+    return DB_OUT_OF_ORDER;
+  }
+  bulk_load_append(loader, row);
+  return DB_SUCCESS;
+}
+
+uint32_t db_bulk_load_finish(BulkLoader* loader) {
+  bulk_load_finish(loader);
+  db_end_write(loader->table);
+
+  uint32_t num_rows = loader->num_rows;
+  free(loader);
+  return num_rows;
+}
+
+uint32_t db_vacuum(Table* table, uint32_t max_pages) {
+  pthread_mutex_lock(&table->write_mutex);
+  uint32_t num_released = table_vacuum(table, max_pages);
+  db_end_write(table);
+  return num_released;
+}
+
+uint32_t db_check(Table* table, uint32_t num_threads) {
+  pthread_mutex_lock(&table->write_mutex);
+  uint32_t num_problems = table_check(table, num_threads);
+  pthread_mutex_unlock(&table->write_mutex);
+  return num_problems;
+}
+
+void db_print_tree(Table* table) {
+  print_tree(table->pager, table->root_page_num, 0);
+}
+
+void db_print_constants() { print_constants(); }
+
+void db_print_cache_stats(Table* table) { print_cache_stats(table->pager); }
+
+void db_stats(Table* table, DbStats* stats) {
+  Pager* pager = table->pager;
+  pthread_mutex_lock(&pager->mutex);
+  stats->cache_hits = pager->stats.hits;
+  stats->cache_misses = pager->stats.misses;
+  stats->cache_evictions = pager->stats.evictions;
+  pthread_mutex_unlock(&pager->mutex);
+  stats_sum(pager->counters, stats);
+  stats->tree_height = table_height(table);
+}
+
+const char* db_operation_name(DbOperation operation) {
+  static const char* names[DB_NUM_OPERATIONS] = {
+      "insert", "get", "delete", "delete range", "find", "scan", "commit"};
+  return names[operation];
+}
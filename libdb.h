@@ -0,0 +1,253 @@
+#ifndef LIBDB_H
+#define LIBDB_H
+
+/*
+ * Public interface of the storage engine. Link against libdb.a or
+ * libdb.so. Every call that changes the table is its own transaction
+ * and is durable once it returns, unless it runs inside db_begin() and
+ * db_commit(). With commit_interval_ms set, commits wait up to that long
+ * for others to share their fdatasync. With async_commit on they return
+ * before it, and a crash may lose the last commit_interval_ms of them.
+ *
+ * Rows come back in caller-supplied Row structs. Unrecoverable I/O
+ * errors print a message and exit the process.
+ *
+ * A Table may be shared between threads. Any number of them can look
+ * up and scan rows while another inserts or deletes; concurrent writes
+ * take turns. A thread must close its own cursors before it writes.
+ * Bulk loading and db_vacuum() need the table to themselves.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+typedef struct {
+  uint32_t id;
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+/*
+ * A row's values where they already are, in a leaf or in the caller's
+ * buffers. The strings are not terminated.
+ */
+typedef struct {
+  uint32_t id;
+  const char* username;
+  uint32_t username_size;
+  const char* email;
+  uint32_t email_size;
+} RowFields;
+
+/* The columns a secondary index can be built on */
+typedef enum { DB_COLUMN_USERNAME, DB_COLUMN_EMAIL } DbColumn;
+#define DB_NUM_INDEXED_COLUMNS 2
+
+typedef struct {
+  uint32_t cache_pages;
+  uint32_t commit_interval_ms;  // 0 syncs the WAL on every commit
+  bool async_commit;            // return from commits before the sync
+  bool use_mmap;                // serve reads from a mapping of the db file
+  uint32_t readahead_pages;     // most leaves a scan reads ahead, 0 for none
+  bool compress_wal;            // log changed pages compressed
+} DbOptions;
+
+typedef enum {
+  DB_SUCCESS,
+  DB_DUPLICATE_KEY,
+  DB_KEY_NOT_FOUND,
+  DB_OUT_OF_ORDER,
+  DB_TRANSACTION_OPEN,
+  DB_NO_TRANSACTION,
+  DB_INDEX_EXISTS,
+  DB_STRING_TOO_LONG,
+} DbResult;
+
+typedef struct Table Table;
+typedef struct Cursor Cursor;
+typedef struct BulkLoader BulkLoader;
+typedef struct DbStatement DbStatement;
+
+DbOptions default_db_options();
+Table* db_open(const char* filename, DbOptions* options);
+void db_close(Table* table);
+
+DbResult db_insert(Table* table, const Row* row);
+DbResult db_get(Table* table, uint32_t id, Row* row);
+
+/*
+ * A prepared insert, for inserting many rows without building a Row for
+ * each. Bind the id and both strings, then db_step() inserts them and
+ * returns what db_insert() would. Bindings are kept between steps, so
+ * only the values that change need binding again; unbound strings are
+ * empty.
+ *
+ * Bound strings are not copied, and need not be terminated: they are
+ * written straight into the leaf from the caller's buffer, which must
+ * stay valid until the statement is stepped. db_bind_text() returns
+ * DB_STRING_TOO_LONG, binding nothing, for a value longer than its
+ * column.
+ */
+DbStatement* db_prepare_insert(Table* table);
+void db_bind_id(DbStatement* statement, uint32_t id);
+DbResult db_bind_text(DbStatement* statement, DbColumn column,
+                      const char* value, uint32_t length);
+DbResult db_step(DbStatement* statement);
+void db_finalize(DbStatement* statement);
+
+/*
+ * db_delete() returns DB_KEY_NOT_FOUND if there is no row with the id.
+ * db_delete_range() removes every row with an id in [first_id, last_id]
+ * as one transaction and returns the number of rows removed. Nodes left
+ * less than half full are refilled from or merged with a sibling, and
+ * pages freed by merges are reused by later inserts.
+ */
+DbResult db_delete(Table* table, uint32_t id);
+uint32_t db_delete_range(Table* table, uint32_t first_id, uint32_t last_id);
+
+/*
+ * Secondary indexes map a username or email to the ids of the rows
+ * that have it, and are kept up to date by every insert and delete.
+ * db_create_index() builds one from the rows already in the table and
+ * returns DB_INDEX_EXISTS if the column has one. Any number of rows
+ * can share a value.
+ *
+ * db_find() copies the rows whose column equals value into rows, in id
+ * order, up to max_rows of them, and returns how many match in all. It
+ * uses the column's index if there is one, and scans the table if not.
+ */
+DbResult db_create_index(Table* table, DbColumn column);
+bool db_has_index(Table* table, DbColumn column);
+uint32_t db_find(Table* table, DbColumn column, const char* value, Row* rows,
+                 uint32_t max_rows);
+
+/*
+ * Groups the changes that follow into one transaction. db_commit()
+ * makes them durable together with a single WAL write and sync, and
+ * db_rollback() discards them. Until then the calling thread sees its
+ * own changes, and other threads see the table as of the last commit
+ * and wait to write. db_close() rolls back a transaction left open.
+ * db_begin() returns DB_TRANSACTION_OPEN if the thread already has one
+ * open, and commit and rollback return DB_NO_TRANSACTION without one.
+ */
+DbResult db_begin(Table* table);
+DbResult db_commit(Table* table);
+DbResult db_rollback(Table* table);
+
+/*
+ * Scans rows in id order starting at the first id >= start_id.
+ * db_cursor_next() copies the next row into *row and returns false
+ * once the scan is past the last row.
+ *
+ * db_cursor_open_range() only visits ids in [first_id, last_id]. It
+ * seeks straight to first_id, so a range costs O(log N + k) pages.
+ */
+Cursor* db_cursor_open(Table* table, uint32_t start_id);
+Cursor* db_cursor_open_range(Table* table, uint32_t first_id,
+                             uint32_t last_id);
+bool db_cursor_next(Cursor* cursor, Row* row);
+void db_cursor_close(Cursor* cursor);
+
+/*
+ * Hands the rest of the scan's rows to visitor one by one, without
+ * copying them out of their leaves. The fields are only valid until
+ * visitor returns, and returning false ends the scan early.
+ */
+typedef bool (*DbRowVisitor)(const RowFields* row, void* context);
+void db_cursor_visit(Cursor* cursor, DbRowVisitor visitor, void* context);
+
+/*
+ * Builds the tree bottom-up from rows appended in increasing id order.
+ * Only an empty table without indexes can be bulk loaded; begin returns
+ * NULL otherwise. Indexes are cheaper to create after the load.
+ * fill_factor (1-100) is how full each node is packed. A row whose id
+ * is not above the previous one is rejected with DB_OUT_OF_ORDER and
+ * can be inserted with db_insert() after db_bulk_load_finish().
+ * finish returns the number of rows loaded.
+ */
+BulkLoader* db_bulk_load_begin(Table* table, uint32_t fill_factor);
+DbResult db_bulk_load_append(BulkLoader* loader, const Row* row);
+uint32_t db_bulk_load_finish(BulkLoader* loader);
+
+/*
+ * Shrinks the file by up to max_pages pages (UINT32_MAX for as many as
+ * possible). Pages in use near the end of the file are moved into free
+ * pages further down, and the freed tail is cut off. Returns the number
+ * of pages released.
+ */
+uint32_t db_vacuum(Table* table, uint32_t max_pages);
+
+/*
+ * Checks the table, its indexes and the freelist as of the last commit:
+ * the checksum of every page in use, key order, parent pointers, the
+ * leaf sibling chains, and that no page is used twice or lost. The
+ * pages are read on num_threads threads, past the buffer pool. Readers
+ * carry on meanwhile, but writers wait. Prints each problem found and
+ * returns how many there were.
+ */
+uint32_t db_check(Table* table, uint32_t num_threads);
+
+/*
+ * Counters kept since the table was opened. Each thread counts into
+ * its own slot, so keeping them costs a few relaxed atomic adds per
+ * call, and db_stats() adds the slots up.
+ *
+ * Bytes read and written are those of read and write calls on the db
+ * file and WAL; pages served from the db file's mapping are not read.
+ * Splits include those of index trees. tree_height is the number of
+ * levels of the table's tree as of the last commit, 1 for a lone leaf.
+ * Checkpoints copy pages from the WAL into the db file, writing each
+ * run of consecutive pages with one call.
+ *
+ * Each call is timed into a histogram by operation: latency[op][b]
+ * counts calls that took [2^b, 2^(b+1)) nanoseconds, the last bucket
+ * also holding any slower ones. A scan is timed from db_cursor_open()
+ * to db_cursor_close(), and db_commit() only covers explicit commits.
+ */
+typedef enum {
+  DB_OP_INSERT,
+  DB_OP_GET,
+  DB_OP_DELETE,
+  DB_OP_DELETE_RANGE,
+  DB_OP_FIND,
+  DB_OP_SCAN,
+  DB_OP_COMMIT,
+} DbOperation;
+#define DB_NUM_OPERATIONS 7
+#define DB_LATENCY_BUCKETS 32
+
+typedef struct {
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cache_evictions;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  uint64_t checkpoint_pages;
+  uint64_t checkpoint_writes;
+  uint32_t tree_height;
+  uint64_t calls[DB_NUM_OPERATIONS];
+  uint64_t total_ns[DB_NUM_OPERATIONS];
+  uint64_t latency[DB_NUM_OPERATIONS][DB_LATENCY_BUCKETS];
+} DbStats;
+
+void db_stats(Table* table, DbStats* stats);
+const char* db_operation_name(DbOperation operation);
+
+/* Debugging output on stdout */
+void db_print_tree(Table* table);
+void db_print_constants();
+void db_print_cache_stats(Table* table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
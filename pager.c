@@ -0,0 +1,1656 @@
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "compress.h"
+#include "pager.h"
+
+Frame* pager_frame(Pager* pager, uint32_t page_num) {
+  if (page_num >= pager->page_table_size ||
+      pager->page_table[page_num] == INVALID_FRAME) {
+    return NULL;
+  }
+  return &pager->frames[pager->page_table[page_num]];
+}
+
+/*
+CRC32C, the Castagnoli polynomial, which SSE4.2 computes with a single
+instruction per eight bytes. CPUs without it use a byte-wise table.
+
+The instruction takes three cycles, but a new one can start every
+cycle. So the SSE4.2 version runs three blocks side by side, and then
+folds them together, which takes advancing a CRC past a block's worth
+of zero bytes. That is linear in the CRC, so it is tabulated as well.
+*/
+#define CRC32C_BLOCK_SIZE 1360  // a multiple of 8
+
+typedef uint32_t (*Crc32cFunction)(const void* data, size_t length);
+
+uint32_t crc32c_table[256];
+uint32_t crc32c_block_shift_table[4][256];
+pthread_once_t crc32c_tables_once = PTHREAD_ONCE_INIT;
+
+void crc32c_tables_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+    crc32c_table[i] = crc;
+  }
+
+  uint32_t bit_shifts[32];
+  for (int bit = 0; bit < 32; bit++) {
+    uint32_t crc = 1u << bit;
+    for (uint32_t i = 0; i < CRC32C_BLOCK_SIZE; i++) {
+      crc = (crc >> 8) ^ crc32c_table[crc & 0xff];
+    }
+    bit_shifts[bit] = crc;
+  }
+  for (int byte = 0; byte < 4; byte++) {
+    for (uint32_t value = 0; value < 256; value++) {
+      uint32_t shifted = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        if (value & (1u << bit)) {
+          shifted ^= bit_shifts[8 * byte + bit];
+        }
+      }
+      crc32c_block_shift_table[byte][value] = shifted;
+    }
+  }
+}
+
+uint32_t crc32c_block_shift(uint32_t crc) {
+  return crc32c_block_shift_table[0][crc & 0xff] ^
+         crc32c_block_shift_table[1][(crc >> 8) & 0xff] ^
+         crc32c_block_shift_table[2][(crc >> 16) & 0xff] ^
+         crc32c_block_shift_table[3][crc >> 24];
+}
+
+uint32_t crc32c_scalar(const void* data, size_t length) {
+  const uint8_t* bytes = data;
+  uint32_t crc = UINT32_MAX;
+  for (size_t i = 0; i < length; i++) {
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ bytes[i]) & 0xff];
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(const void* data,
+                                                         size_t length) {
+  const uint8_t* bytes = data;
+  uint64_t crc = UINT32_MAX;
+  size_t i = 0;
+  for (; i + 3 * CRC32C_BLOCK_SIZE <= length; i += 3 * CRC32C_BLOCK_SIZE) {
+    const uint8_t* block = bytes + i;
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (size_t j = 0; j < CRC32C_BLOCK_SIZE; j += sizeof(uint64_t)) {
+      uint64_t words[3];
+      memcpy(&words[0], block + j, sizeof(uint64_t));
+      memcpy(&words[1], block + CRC32C_BLOCK_SIZE + j, sizeof(uint64_t));
+      memcpy(&words[2], block + 2 * CRC32C_BLOCK_SIZE + j, sizeof(uint64_t));
+      crc = _mm_crc32_u64(crc, words[0]);
+      crc1 = _mm_crc32_u64(crc1, words[1]);
+      crc2 = _mm_crc32_u64(crc2, words[2]);
+    }
+    crc = crc32c_block_shift(crc) ^ crc1;
+    crc = crc32c_block_shift(crc) ^ crc2;
+  }
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+  for (; i < length; i++) {
+    crc = _mm_crc32_u8(crc, bytes[i]);
+  }
+  return ~(uint32_t)crc;
+}
+#endif
+
+uint32_t crc32c_dispatch(const void* data, size_t length);
+
+/* Picked on first use from what the CPU supports */
+Crc32cFunction crc32c = crc32c_dispatch;
+
+uint32_t crc32c_dispatch(const void* data, size_t length) {
+  pthread_once(&crc32c_tables_once, crc32c_tables_init);
+  Crc32cFunction function = crc32c_scalar;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    function = crc32c_sse42;
+  }
+#endif
+  /* Released, so that whoever picks it up also sees the tables */
+  __atomic_store_n(&crc32c, function, __ATOMIC_RELEASE);
+  return function(data, length);
+}
+
+uint32_t page_checksum(void* page) {
+  Crc32cFunction function = __atomic_load_n(&crc32c, __ATOMIC_ACQUIRE);
+  return function(page, PAGE_USABLE_SIZE);
+}
+
+void page_set_checksum(void* page) {
+  uint32_t checksum = page_checksum(page);
+  memcpy(page + PAGE_USABLE_SIZE, &checksum, PAGE_CHECKSUM_SIZE);
+}
+
+bool page_checksum_ok(void* page) {
+  uint32_t checksum;
+  memcpy(&checksum, page + PAGE_USABLE_SIZE, PAGE_CHECKSUM_SIZE);
+  return checksum == page_checksum(page);
+}
+
+/* Stop before a page that was torn or rotted on disk is used */
+void page_corrupt(uint32_t page_num) {
+  printf("Page %u failed its checksum. Corrupt file.\n", page_num);
+  exit(EXIT_FAILURE);
+}
+
+uint32_t wal_checksum(WalRecordHeader* header, void* image) {
+  /* FNV-1a over the header fields before the checksum, then the image */
+  uint32_t hash = 2166136261u;
+  uint8_t* bytes = (uint8_t*)header;
+  for (size_t i = 0; i < offsetof(WalRecordHeader, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  bytes = image;
+  for (uint32_t i = 0; i < header->image_size; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+size_t wal_record_size(WalRecordHeader* header) {
+  return sizeof(WalRecordHeader) + header->image_size;
+}
+
+/*
+Point iov at the image of the page to log, which is the page itself,
+or its compressed copy in buffer if the log compresses pages and that
+is smaller. buffer needs room for PAGE_COMPRESS_BOUND bytes. Returns
+the size of the image.
+*/
+uint32_t wal_page_image(Wal* wal, void* page, void* buffer,
+                        struct iovec* iov) {
+  iov->iov_base = page;
+  iov->iov_len = PAGE_SIZE;
+  if (wal->compress) {
+    uint32_t size = page_compress(page, buffer);
+    if (size < PAGE_SIZE) {
+      iov->iov_base = buffer;
+      iov->iov_len = size;
+    }
+  }
+  return iov->iov_len;
+}
+
+/*
+Read the page logged by the record at offset. Returns false if the
+record holds no whole page image, as when a restart of the log
+overwrote it during the read.
+*/
+bool wal_read_page(Wal* wal, off_t offset, void* page) {
+  uint8_t record[sizeof(WalRecordHeader) + PAGE_SIZE];
+  ssize_t bytes_read =
+      pread(wal->file_descriptor, record, sizeof(record), offset);
+  if (bytes_read == -1) {
+    printf("Error reading WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats_add(wal->counters, STAT_BYTES_READ, bytes_read);
+  WalRecordHeader header;
+  if (bytes_read < (ssize_t)sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, record, sizeof(header));
+  uint8_t* image = record + sizeof(header);
+  if (header.page_num == INVALID_PAGE_NUM ||
+      header.image_size > bytes_read - sizeof(header)) {
+    return false;
+  }
+  if (header.image_size == PAGE_SIZE) {
+    memcpy(page, image, PAGE_SIZE);
+    return true;
+  }
+  return page_decompress(image, header.image_size, page);
+}
+
+/*
+Return the offset of the page's newest record that starts before end,
+or 0 if the log has none.
+*/
+off_t wal_index_get_before(Wal* wal, uint32_t page_num, off_t end) {
+  uint32_t version =
+      page_num < wal->index_size ? wal->index[page_num] : WAL_NO_VERSION;
+  while (version != WAL_NO_VERSION && wal->versions[version].offset >= end) {
+    version = wal->versions[version].previous;
+  }
+  return version != WAL_NO_VERSION ? wal->versions[version].offset : 0;
+}
+
+off_t wal_index_get(Wal* wal, uint32_t page_num) {
+  if (page_num >= wal->index_size || wal->index[page_num] == WAL_NO_VERSION) {
+    return 0;
+  }
+  return wal->versions[wal->index[page_num]].offset;
+}
+
+void wal_index_set(Wal* wal, uint32_t page_num, off_t offset) {
+  if (page_num >= wal->index_size) {
+    uint32_t new_size = wal->index_size > 0 ? wal->index_size : 64;
+    while (new_size <= page_num) {
+      new_size *= 2;
+    }
+    wal->index = realloc(wal->index, new_size * sizeof(uint32_t));
+    memset(wal->index + wal->index_size, 0xff,
+           (new_size - wal->index_size) * sizeof(uint32_t));
+    wal->index_size = new_size;
+  }
+  if (wal->num_versions == wal->versions_capacity) {
+    wal->versions_capacity =
+        wal->versions_capacity ? wal->versions_capacity * 2 : 64;
+    wal->versions =
+        realloc(wal->versions, wal->versions_capacity * sizeof(WalVersion));
+  }
+  WalVersion* version = &wal->versions[wal->num_versions];
+  version->offset = offset;
+  version->previous = wal->index[page_num];
+  wal->index[page_num] = wal->num_versions++;
+}
+
+/* The oldest open snapshot, or UINT64_MAX. The caller holds wal->mutex. */
+Snapshot wal_oldest_snapshot(Wal* wal) {
+  Snapshot oldest = UINT64_MAX;
+  for (uint32_t i = 0; i < wal->num_snapshots; i++) {
+    if (wal->snapshots[i] < oldest) {
+      oldest = wal->snapshots[i];
+    }
+  }
+  return oldest;
+}
+
+void wal_write(Wal* wal, struct iovec* iov, int iovcnt, off_t offset) {
+  while (iovcnt > 0) {
+    int batch = iovcnt < WAL_MAX_IOVECS ? iovcnt : WAL_MAX_IOVECS;
+    size_t expected = 0;
+    for (int i = 0; i < batch; i++) {
+      expected += iov[i].iov_len;
+    }
+
+    ssize_t bytes_written = pwritev(wal->file_descriptor, iov, batch, offset);
+    if (bytes_written != (ssize_t)expected) {
+      printf("Error writing WAL: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    stats_add(wal->counters, STAT_BYTES_WRITTEN, expected);
+
+    iov += batch;
+    iovcnt -= batch;
+    offset += expected;
+  }
+}
+
+void wal_sync(Wal* wal) {
+  if (fdatasync(wal->file_descriptor) == -1) {
+    printf("Error syncing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void wal_reset(Wal* wal) {
+  if (ftruncate(wal->file_descriptor, 0) == -1) {
+    printf("Error truncating WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t header[2] = {WAL_MAGIC, wal->salt};
+  struct iovec iov = {header, WAL_HEADER_SIZE};
+  wal_write(wal, &iov, 1, 0);
+  wal_sync(wal);
+
+  wal->generation_start += wal->length;
+  wal->length = WAL_HEADER_SIZE;
+  wal->committed_length = WAL_HEADER_SIZE;
+  wal->synced_length = WAL_HEADER_SIZE;
+  wal->checkpointed_length = WAL_HEADER_SIZE;
+  memset(wal->index, 0xff, wal->index_size * sizeof(uint32_t));
+  wal->num_versions = 0;
+}
+
+void wal_restart_if_checkpointed(Wal* wal) {
+  /*
+  Once everything in the log has been folded into the db file, the
+  next transaction starts over at the top of the log. The new salt
+  keeps stale records from an older generation from being replayed.
+  A snapshot from before the end of the log may still need the older
+  versions in it, so the log is kept until it is closed.
+  */
+  pthread_mutex_lock(&wal->mutex);
+  if (!wal->checkpoint_running && wal->length > WAL_HEADER_SIZE &&
+      wal->checkpointed_length == wal->length &&
+      wal_oldest_snapshot(wal) >= wal->generation_start + wal->length) {
+    wal->salt++;
+    wal_reset(wal);
+  }
+  pthread_mutex_unlock(&wal->mutex);
+}
+
+/* Write num_pages pages to the db file, the first at page_num */
+void checkpoint_write_run(Pager* pager, uint32_t page_num, void* pages,
+                          uint32_t num_pages) {
+  size_t size = (size_t)num_pages * PAGE_SIZE;
+  if (pwrite(pager->file_descriptor, pages, size,
+             (off_t)page_num * PAGE_SIZE) != (ssize_t)size) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats_add(pager->counters, STAT_BYTES_WRITTEN, size);
+  stats_add(pager->counters, STAT_CHECKPOINT_PAGES, num_pages);
+  stats_add(pager->counters, STAT_CHECKPOINT_WRITES, 1);
+}
+
+void wal_checkpoint(Pager* pager, off_t start, off_t end) {
+  /*
+  Fold the records in [start, end) into the db file. Only the newest
+  record of each page is copied, in page order, and pages with
+  consecutive numbers are gathered into runs that are written with
+  one call each. The file is then cut to the size recorded by the last
+  commit, which drops the pages a vacuum released.
+  */
+  Wal* wal = &pager->wal;
+  if (start >= end) {
+    return;
+  }
+
+  off_t* newest = NULL;
+  uint32_t newest_size = 0;
+  uint32_t commit_num_pages = INVALID_PAGE_NUM;
+  for (off_t offset = start; offset < end;) {
+    WalRecordHeader header;
+    if (pread(wal->file_descriptor, &header, sizeof(header), offset) !=
+        sizeof(header)) {
+      printf("Error reading WAL: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    if (header.page_num != INVALID_PAGE_NUM) {
+      if (header.page_num >= newest_size) {
+        uint32_t new_size = header.page_num + 1;
+        newest = realloc(newest, new_size * sizeof(off_t));
+        memset(newest + newest_size, 0,
+               (new_size - newest_size) * sizeof(off_t));
+        newest_size = new_size;
+      }
+      newest[header.page_num] = offset;
+    }
+    if (header.commit_num_pages != 0) {
+      commit_num_pages = header.commit_num_pages;
+    }
+    offset += wal_record_size(&header);
+  }
+
+  uint8_t* run = malloc((size_t)CHECKPOINT_MAX_RUN_PAGES * PAGE_SIZE);
+  uint32_t run_start = 0;
+  uint32_t run_length = 0;
+  for (uint32_t page_num = 0; page_num < newest_size; page_num++) {
+    if (newest[page_num] == 0 || page_num >= commit_num_pages) {
+      continue;
+    }
+    if (run_length > 0 && (page_num != run_start + run_length ||
+                           run_length == CHECKPOINT_MAX_RUN_PAGES)) {
+      checkpoint_write_run(pager, run_start, run, run_length);
+      run_length = 0;
+    }
+    if (run_length == 0) {
+      run_start = page_num;
+    }
+    if (!wal_read_page(wal, newest[page_num],
+                       run + (size_t)run_length * PAGE_SIZE)) {
+      page_corrupt(page_num);
+    }
+    run_length++;
+  }
+  if (run_length > 0) {
+    checkpoint_write_run(pager, run_start, run, run_length);
+  }
+  free(run);
+  free(newest);
+
+  if (commit_num_pages != INVALID_PAGE_NUM &&
+      ftruncate(pager->file_descriptor, (off_t)commit_num_pages * PAGE_SIZE) ==
+          -1) {
+    printf("Error truncating db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (fdatasync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void* wal_thread_main(void* argument) {
+  /*
+  Syncs commits that were batched by commit_interval_ms, and folds
+  the durable part of the log into the db file once it grows past
+  WAL_AUTOCHECKPOINT_PAGES. Records past the oldest open snapshot stay
+  out of the db file, which that snapshot may still be reading.
+  Committers waiting in pager_wait_synced() share cond with this
+  thread, so it is always broadcast.
+  */
+  Pager* pager = argument;
+  Wal* wal = &pager->wal;
+  off_t checkpoint_threshold = (off_t)WAL_AUTOCHECKPOINT_PAGES * PAGE_SIZE;
+
+  pthread_mutex_lock(&wal->mutex);
+  while (!wal->stop) {
+    if (wal->synced_length < wal->committed_length) {
+      struct timespec deadline = wal->oldest_unsynced_commit;
+      deadline.tv_sec += wal->commit_interval_ms / 1000;
+      deadline.tv_nsec += (wal->commit_interval_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      if (now.tv_sec < deadline.tv_sec ||
+          (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec)) {
+        pthread_cond_timedwait(&wal->cond, &wal->mutex, &deadline);
+        continue;
+      }
+
+      off_t target = wal->committed_length;
+      pthread_mutex_unlock(&wal->mutex);
+      wal_sync(wal);
+      pthread_mutex_lock(&wal->mutex);
+      if (target > wal->synced_length) {
+        wal->synced_length = target;
+      }
+      pthread_cond_broadcast(&wal->cond);
+      continue;
+    }
+
+    off_t end = wal->synced_length;
+    Snapshot oldest = wal_oldest_snapshot(wal);
+    if (oldest < wal->generation_start + end) {
+      end = oldest > wal->generation_start ? oldest - wal->generation_start
+                                           : WAL_HEADER_SIZE;
+    }
+    if (end - wal->checkpointed_length >= checkpoint_threshold) {
+      off_t start = wal->checkpointed_length;
+      wal->checkpoint_running = true;
+      pthread_mutex_unlock(&wal->mutex);
+      wal_checkpoint(pager, start, end);
+      pthread_mutex_lock(&wal->mutex);
+      wal->checkpointed_length = end;
+      wal->checkpoint_running = false;
+      continue;
+    }
+
+    pthread_cond_wait(&wal->cond, &wal->mutex);
+  }
+  pthread_mutex_unlock(&wal->mutex);
+
+  return NULL;
+}
+
+void wal_recover(Pager* pager) {
+  /*
+  Replay a log left behind by a crash. Records are trusted up to the
+  last valid commit record. Anything after it belonged to a
+  transaction that never committed, or was torn by the crash.
+  */
+  Wal* wal = &pager->wal;
+  off_t wal_length = lseek(wal->file_descriptor, 0, SEEK_END);
+  uint32_t header[2];
+  if (wal_length < (off_t)WAL_HEADER_SIZE ||
+      pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) !=
+          WAL_HEADER_SIZE ||
+      header[0] != WAL_MAGIC) {
+    return;
+  }
+  wal->salt = header[1];
+
+  void* page = malloc(PAGE_SIZE);
+  off_t offset = WAL_HEADER_SIZE;
+  off_t committed_end = WAL_HEADER_SIZE;
+  while (offset + (off_t)sizeof(WalRecordHeader) <= wal_length) {
+    WalRecordHeader record;
+    if (pread(wal->file_descriptor, &record, sizeof(record), offset) !=
+            sizeof(record) ||
+        record.salt != wal->salt || record.image_size > PAGE_SIZE ||
+        pread(wal->file_descriptor, page, record.image_size,
+              offset + sizeof(record)) != record.image_size ||
+        wal_checksum(&record, page) != record.checksum) {
+      break;
+    }
+
+    offset += wal_record_size(&record);
+    if (record.commit_num_pages != 0) {
+      committed_end = offset;
+    }
+  }
+  free(page);
+
+  wal_checkpoint(pager, WAL_HEADER_SIZE, committed_end);
+}
+
+void wal_open(Pager* pager, const char* db_filename, DbOptions* options) {
+  Wal* wal = &pager->wal;
+  wal->filename = malloc(strlen(db_filename) + 5);
+  sprintf(wal->filename, "%s-wal", db_filename);
+
+  wal->file_descriptor =
+      open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (wal->file_descriptor == -1) {
+    printf("Unable to open WAL file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  wal->index = NULL;
+  wal->index_size = 0;
+  wal->versions = NULL;
+  wal->num_versions = 0;
+  wal->versions_capacity = 0;
+  wal->generation_start = 0;
+  wal->length = 0;
+  wal->snapshots = NULL;
+  wal->num_snapshots = 0;
+  wal->snapshots_capacity = 0;
+  wal->commit_interval_ms = options->commit_interval_ms;
+  wal->async_commit = options->async_commit;
+  wal->compress = options->compress_wal;
+  wal->counters = pager->counters;
+  wal->salt = (uint32_t)time(NULL);
+  wal_recover(pager);
+  wal->salt++;
+  wal_reset(wal);
+
+  wal->checkpoint_running = false;
+  wal->stop = false;
+  pthread_mutex_init(&wal->mutex, NULL);
+  pthread_cond_init(&wal->cond, NULL);
+  pthread_create(&wal->thread, NULL, wal_thread_main, pager);
+}
+
+void wal_close(Pager* pager) {
+  /*
+  Fold the whole log into the db file. After a clean close the db
+  file is complete on its own and the log is removed.
+  */
+  Wal* wal = &pager->wal;
+  pthread_mutex_lock(&wal->mutex);
+  wal->stop = true;
+  pthread_cond_broadcast(&wal->cond);
+  pthread_mutex_unlock(&wal->mutex);
+  pthread_join(wal->thread, NULL);
+
+  wal_sync(wal);
+  wal_checkpoint(pager, wal->checkpointed_length, wal->committed_length);
+
+  close(wal->file_descriptor);
+  unlink(wal->filename);
+  pthread_mutex_destroy(&wal->mutex);
+  pthread_cond_destroy(&wal->cond);
+  free(wal->index);
+  free(wal->versions);
+  free(wal->snapshots);
+  free(wal->filename);
+}
+
+void pager_mark_dirty(Pager* pager, Frame* frame) {
+  frame->dirty = true;
+  if (frame->mapped) {
+    frame->copied = true;
+  }
+  if (frame->in_txn) {
+    return;
+  }
+
+  frame->in_txn = true;
+  if (pager->num_txn_pages == pager->txn_pages_capacity) {
+    pager->txn_pages_capacity =
+        pager->txn_pages_capacity ? pager->txn_pages_capacity * 2 : 64;
+    pager->txn_pages = realloc(pager->txn_pages,
+                               pager->txn_pages_capacity * sizeof(uint32_t));
+  }
+  pager->txn_pages[pager->num_txn_pages++] = frame->page_num;
+}
+
+void pager_spill_frame(Pager* pager, Frame* frame) {
+  /*
+  A dirty page evicted before its transaction commits goes to the
+  WAL without a commit mark. It only takes effect once a later commit
+  record follows it.
+  */
+  Wal* wal = &pager->wal;
+  if (pager->num_txn_pages > 0 && !pager->txn_spilled) {
+    wal_restart_if_checkpointed(wal);
+  }
+
+  WalRecordHeader header = {frame->page_num, 0, wal->salt, 0, 0};
+  page_set_checksum(frame->page);
+  uint8_t buffer[PAGE_COMPRESS_BOUND];
+  struct iovec iov[2] = {{&header, sizeof(header)}};
+  header.image_size = wal_page_image(wal, frame->page, buffer, &iov[1]);
+  header.checksum = wal_checksum(&header, iov[1].iov_base);
+  off_t offset = wal->length;
+  wal_write(wal, iov, 2, offset);
+  wal_index_set(wal, frame->page_num, offset);
+
+  pthread_mutex_lock(&wal->mutex);
+  wal->length = offset + wal_record_size(&header);
+  pthread_mutex_unlock(&wal->mutex);
+
+  frame->dirty = false;
+  pager->txn_spilled = true;
+  pager->stats.writebacks++;
+  pager->stats.wal_pages++;
+  pager->stats.wal_bytes += header.image_size;
+}
+
+/*
+Return working memory for a commit of size bytes. It is kept for the
+next commit unless it is unusually large, so commits of a similar size
+reuse it without going to the heap. The caller holds pager->mutex.
+*/
+void* pager_commit_scratch(Pager* pager, size_t size) {
+  if (size > pager->commit_scratch_size) {
+    free(pager->commit_scratch);
+    pager->commit_scratch = malloc(size);
+    pager->commit_scratch_size = size;
+  }
+  return pager->commit_scratch;
+}
+
+void pager_commit_scratch_done(Pager* pager) {
+  if (pager->commit_scratch_size > PAGER_MAX_KEPT_SCRATCH) {
+    free(pager->commit_scratch);
+    pager->commit_scratch = NULL;
+    pager->commit_scratch_size = 0;
+  }
+}
+
+Snapshot pager_commit(Pager* pager) {
+  /*
+  Append every page dirtied since the last commit to the WAL with a
+  single write. The last record carries the commit mark. With
+  commit_interval_ms set or async_commit on, the sync is left to the
+  WAL thread so that all commits within the interval share one
+  fdatasync. Returns the position the log must be synced to for the
+  commit to be durable, for pager_wait_synced().
+  */
+  Wal* wal = &pager->wal;
+  pthread_mutex_lock(&pager->mutex);
+  if (pager->num_txn_pages == 0 && !pager->txn_spilled) {
+    pthread_mutex_unlock(&pager->mutex);
+    return 0;
+  }
+  if (!pager->txn_spilled) {
+    wal_restart_if_checkpointed(wal);
+  }
+
+  /*
+  Compressed images are packed one after another in images. The pieces
+  are laid out most aligned first, so none of them needs padding.
+  */
+  uint32_t max_records = pager->num_txn_pages + 1;
+  size_t images_size =
+      wal->compress ? (size_t)max_records * PAGE_SIZE + PAGE_COMPRESS_BOUND
+                    : 0;
+  struct iovec* iov = pager_commit_scratch(
+      pager, 2 * max_records * sizeof(struct iovec) +
+                 max_records * (sizeof(Frame*) + sizeof(WalRecordHeader)) +
+                 images_size);
+  Frame** frames = (Frame**)(iov + 2 * max_records);
+  WalRecordHeader* headers = (WalRecordHeader*)(frames + max_records);
+  uint8_t* images = wal->compress ? (uint8_t*)(headers + max_records) : NULL;
+  size_t images_length = 0;
+  uint32_t num_records = 0;
+  for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+    Frame* frame = pager_frame(pager, pager->txn_pages[i]);
+    if (frame == NULL || !frame->in_txn) {
+      continue;
+    }
+    frame->in_txn = false;
+    if (!frame->dirty) {
+      continue;
+    }
+    WalRecordHeader header = {frame->page_num, 0, wal->salt, 0, 0};
+    headers[num_records] = header;
+    frames[num_records] = frame;
+    num_records++;
+  }
+
+  if (num_records == 0) {
+    /* Everything was spilled already. Commit with a bare record. */
+    WalRecordHeader header = {INVALID_PAGE_NUM, 0, wal->salt, 0, 0};
+    headers[0] = header;
+    frames[0] = NULL;
+    num_records = 1;
+  }
+  headers[num_records - 1].commit_num_pages = pager->num_pages;
+  pager->committed_num_pages = pager->num_pages;
+
+  int iovcnt = 0;
+  off_t offset = wal->length;
+  for (uint32_t i = 0; i < num_records; i++) {
+    struct iovec* header_iov = &iov[iovcnt++];
+    header_iov->iov_base = &headers[i];
+    header_iov->iov_len = sizeof(WalRecordHeader);
+    void* image = NULL;
+    if (frames[i] != NULL) {
+      void* page = frames[i]->page;
+      page_set_checksum(page);
+      struct iovec* image_iov = &iov[iovcnt++];
+      uint8_t* buffer = images != NULL ? images + images_length : NULL;
+      headers[i].image_size = wal_page_image(wal, page, buffer, image_iov);
+      image = image_iov->iov_base;
+      if (image != page) {
+        images_length += headers[i].image_size;
+      }
+      wal_index_set(wal, headers[i].page_num, offset);
+      frames[i]->dirty = false;
+      pager->stats.wal_pages++;
+      pager->stats.wal_bytes += headers[i].image_size;
+    }
+    headers[i].checksum = wal_checksum(&headers[i], image);
+    offset += wal_record_size(&headers[i]);
+  }
+  wal_write(wal, iov, iovcnt, wal->length);
+  pager_commit_scratch_done(pager);
+  pager->num_txn_pages = 0;
+  pager->txn_spilled = false;
+
+  pthread_mutex_lock(&wal->mutex);
+  if (wal->synced_length == wal->committed_length) {
+    clock_gettime(CLOCK_REALTIME, &wal->oldest_unsynced_commit);
+  }
+  wal->length = offset;
+  wal->committed_length = offset;
+  Snapshot position = wal->generation_start + offset;
+  /* Readers only wait for the append, never for the sync */
+  pthread_mutex_unlock(&pager->mutex);
+  if (wal->commit_interval_ms == 0 && !wal->async_commit) {
+    pthread_mutex_unlock(&wal->mutex);
+    wal_sync(wal);
+    pthread_mutex_lock(&wal->mutex);
+    wal->synced_length = offset;
+  }
+  pthread_cond_broadcast(&wal->cond);
+  pthread_mutex_unlock(&wal->mutex);
+  return position;
+}
+
+/*
+Wait until the log is synced up to position, as returned by
+pager_commit(). The caller should hold no locks a later committer
+needs, so that the commits of the interval can pile up behind one
+fdatasync. With async_commit on this returns at once.
+*/
+void pager_wait_synced(Pager* pager, Snapshot position) {
+  Wal* wal = &pager->wal;
+  if (wal->async_commit) {
+    return;
+  }
+  pthread_mutex_lock(&wal->mutex);
+  while (wal->generation_start + wal->synced_length < position) {
+    pthread_cond_wait(&wal->cond, &wal->mutex);
+  }
+  pthread_mutex_unlock(&wal->mutex);
+}
+
+/* Empty an unpinned frame without writing its page anywhere */
+void pager_drop_frame(Pager* pager, Frame* frame) {
+  if (frame->copied) {
+    madvise(frame->page, PAGE_SIZE, MADV_DONTNEED);
+  }
+  pager->page_table[frame->page_num] = INVALID_FRAME;
+  frame->page = frame->buffer;
+  frame->page_num = INVALID_PAGE_NUM;
+  frame->dirty = false;
+  frame->in_txn = false;
+  frame->mapped = false;
+  frame->copied = false;
+}
+
+void pager_rollback(Pager* pager) {
+  /*
+  Throw away every change since the last commit. The frames of pages
+  the transaction dirtied are dropped, so the next access reads the
+  committed copy again, and records it spilled into the WAL are cut
+  off the end of the log. Other threads read at a snapshot while the
+  transaction is open, which never touches the buffer pool, so any pin
+  left on one of these pages is only waited out.
+  */
+  Wal* wal = &pager->wal;
+  pthread_mutex_lock(&pager->mutex);
+  for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+    uint32_t page_num = pager->txn_pages[i];
+    Frame* frame = pager_frame(pager, page_num);
+    while (frame != NULL && frame->pin_count > 0) {
+      pthread_mutex_unlock(&pager->mutex);
+      sched_yield();
+      pthread_mutex_lock(&pager->mutex);
+      frame = pager_frame(pager, page_num);
+    }
+    if (frame != NULL) {
+      pager_drop_frame(pager, frame);
+    }
+
+    while (page_num < wal->index_size &&
+           wal->index[page_num] != WAL_NO_VERSION &&
+           wal->versions[wal->index[page_num]].offset >=
+               wal->committed_length) {
+      wal->index[page_num] = wal->versions[wal->index[page_num]].previous;
+    }
+  }
+  while (wal->num_versions > 0 &&
+         wal->versions[wal->num_versions - 1].offset >=
+             wal->committed_length) {
+    wal->num_versions--;
+  }
+
+  if (pager->txn_spilled &&
+      ftruncate(wal->file_descriptor, wal->committed_length) == -1) {
+    printf("Error truncating WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_lock(&wal->mutex);
+  wal->length = wal->committed_length;
+  pthread_mutex_unlock(&wal->mutex);
+
+  pager->num_pages = pager->committed_num_pages;
+  pager->num_txn_pages = 0;
+  pager->txn_spilled = false;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+void pager_grow_page_table(Pager* pager, uint32_t page_num) {
+  uint32_t new_size = pager->page_table_size;
+  while (new_size <= page_num) {
+    new_size *= 2;
+  }
+  pager->page_table = realloc(pager->page_table, new_size * sizeof(uint32_t));
+  for (uint32_t i = pager->page_table_size; i < new_size; i++) {
+    pager->page_table[i] = INVALID_FRAME;
+  }
+  pager->page_table_size = new_size;
+}
+
+uint32_t pager_find_victim(Pager* pager) {
+  /*
+  Hand out never-used frames first. After that, run the CLOCK
+  algorithm: sweep the frames, clearing the reference bit of each
+  recently used one and taking the first unpinned frame whose bit
+  is already clear. Two full sweeps without a victim means every
+  frame is pinned.
+  */
+  if (pager->num_frames_used < pager->num_frames) {
+    return pager->num_frames_used++;
+  }
+
+  for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+    uint32_t frame_index = pager->clock_hand;
+    Frame* frame = &pager->frames[frame_index];
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+    if (frame->pin_count > 0) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+    return frame_index;
+  }
+
+  printf("Buffer pool exhausted: all %d frames are pinned.\n",
+         pager->num_frames);
+  exit(EXIT_FAILURE);
+}
+
+/*
+Find the page's frame, loading the page into the buffer pool if
+needed, and pin it. The caller holds pager->mutex.
+*/
+Frame* pager_pin(Pager* pager, uint32_t page_num) {
+  if (page_num == INVALID_PAGE_NUM) {
+    printf("Tried to fetch page number out of bounds. %u\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  if (page_num >= pager->page_table_size) {
+    pager_grow_page_table(pager, page_num);
+  }
+
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame != NULL) {
+    pager->stats.hits++;
+  } else {
+    // Cache miss. Claim a frame, writing back its old page if needed.
+    pager->stats.misses++;
+    uint32_t frame_index = pager_find_victim(pager);
+    frame = &pager->frames[frame_index];
+
+    if (frame->page_num != INVALID_PAGE_NUM) {
+      if (frame->dirty) {
+        pager_spill_frame(pager, frame);
+      }
+      if (frame->copied) {
+        // Drop the private copy; the WAL now holds this version
+        madvise(frame->page, PAGE_SIZE, MADV_DONTNEED);
+      }
+      pager->page_table[frame->page_num] = INVALID_FRAME;
+      pager->stats.evictions++;
+    }
+    frame->page = frame->buffer;
+    frame->page_num = page_num;
+    frame->pin_count = 0;
+    frame->in_txn = false;
+    frame->mapped = false;
+    frame->copied = false;
+    pager->page_table[page_num] = frame_index;
+
+    if (page_num < pager->num_pages) {
+      // The newest copy is in the WAL if the page was logged since
+      // the last checkpoint, otherwise in the db file.
+      off_t wal_offset = wal_index_get(&pager->wal, page_num);
+      ssize_t bytes_read;
+      if (wal_offset == 0 && page_num < pager->map_num_pages) {
+        frame->page = pager->map + (size_t)page_num * PAGE_SIZE;
+        frame->mapped = true;
+        bytes_read = PAGE_SIZE;
+      } else if (wal_offset != 0) {
+        if (!wal_read_page(&pager->wal, wal_offset, frame->page)) {
+          page_corrupt(page_num);
+        }
+        bytes_read = PAGE_SIZE;
+      } else {
+        bytes_read = pread(pager->file_descriptor, frame->page, PAGE_SIZE,
+                           (off_t)page_num * PAGE_SIZE);
+        if (bytes_read > 0) {
+          stats_add(pager->counters, STAT_BYTES_READ, bytes_read);
+        }
+      }
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      if (bytes_read < PAGE_SIZE) {
+        memset(frame->page + bytes_read, 0, PAGE_SIZE - bytes_read);
+      }
+      if (!page_checksum_ok(frame->page)) {
+        page_corrupt(page_num);
+      }
+      frame->dirty = false;
+    } else {
+      // New page. It must reach the file even if nobody writes to it.
+      memset(frame->page, 0, PAGE_SIZE);
+      pager_mark_dirty(pager, frame);
+    }
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  }
+
+  frame->pin_count++;
+  frame->referenced = true;
+  return frame;
+}
+
+/*
+Return the page, loading it into the buffer pool if needed.
+The page stays pinned in memory until the caller releases it
+with unpin_page().
+*/
+void* get_page(Pager* pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->mutex);
+  void* page = pager_pin(pager, page_num)->page;
+  pthread_mutex_unlock(&pager->mutex);
+  return page;
+}
+
+/*
+Open a snapshot of everything committed so far. Until it is ended,
+pager_read_snapshot() can read any page as it was at this point.
+*/
+Snapshot pager_snapshot_begin(Pager* pager) {
+  Wal* wal = &pager->wal;
+  pthread_mutex_lock(&wal->mutex);
+  if (wal->num_snapshots == wal->snapshots_capacity) {
+    wal->snapshots_capacity =
+        wal->snapshots_capacity ? wal->snapshots_capacity * 2 : 16;
+    wal->snapshots =
+        realloc(wal->snapshots, wal->snapshots_capacity * sizeof(Snapshot));
+  }
+  Snapshot snapshot = wal->generation_start + wal->committed_length;
+  wal->snapshots[wal->num_snapshots++] = snapshot;
+  pthread_mutex_unlock(&wal->mutex);
+  return snapshot;
+}
+
+void pager_snapshot_end(Pager* pager, Snapshot snapshot) {
+  Wal* wal = &pager->wal;
+  pthread_mutex_lock(&wal->mutex);
+  for (uint32_t i = 0; i < wal->num_snapshots; i++) {
+    if (wal->snapshots[i] == snapshot) {
+      wal->snapshots[i] = wal->snapshots[--wal->num_snapshots];
+      break;
+    }
+  }
+  /* A checkpoint may have been waiting for this snapshot */
+  pthread_cond_broadcast(&wal->cond);
+  pthread_mutex_unlock(&wal->mutex);
+}
+
+/*
+Copy the page as of the snapshot into page. This never touches the
+buffer pool, so it neither waits for the writer nor sees its changes.
+Its newest record before the snapshot is read from the log, and a page
+with none is read from the db file, which checkpoints keep at least as
+old as the snapshot. If the log restarts during the read, the record
+read may have been overwritten, but by then the snapshot is older than
+the whole log, so it is read again from the db file.
+Returns false if the page fails its checksum.
+*/
+bool pager_try_read_snapshot(Pager* pager, Snapshot snapshot,
+                             uint32_t page_num, void* page) {
+  Wal* wal = &pager->wal;
+  while (true) {
+    pthread_mutex_lock(&pager->mutex);
+    uint64_t generation_start = wal->generation_start;
+    off_t end = snapshot > generation_start ? snapshot - generation_start : 0;
+    off_t wal_offset = wal_index_get_before(wal, page_num, end);
+    pthread_mutex_unlock(&pager->mutex);
+
+    if (wal_offset == 0) {
+      ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE,
+                                 (off_t)page_num * PAGE_SIZE);
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      stats_add(pager->counters, STAT_BYTES_READ, bytes_read);
+      if (bytes_read < PAGE_SIZE) {
+        memset(page + bytes_read, 0, PAGE_SIZE - bytes_read);
+      }
+      return page_checksum_ok(page);
+    }
+    bool read = wal_read_page(wal, wal_offset, page);
+
+    pthread_mutex_lock(&pager->mutex);
+    bool restarted = (wal->generation_start != generation_start);
+    pthread_mutex_unlock(&pager->mutex);
+    if (!restarted) {
+      return read && page_checksum_ok(page);
+    }
+  }
+}
+
+void pager_read_snapshot(Pager* pager, Snapshot snapshot, uint32_t page_num,
+                         void* page) {
+  if (!pager_try_read_snapshot(pager, snapshot, page_num, page)) {
+    page_corrupt(page_num);
+  }
+}
+
+/*
+Pin the page and latch it. Waiting for the latch happens outside
+pager->mutex, and the pin keeps the frame from being reused meanwhile.
+*/
+void* latch_page(Pager* pager, uint32_t page_num, LatchMode mode) {
+  pthread_mutex_lock(&pager->mutex);
+  Frame* frame = pager_pin(pager, page_num);
+  pthread_mutex_unlock(&pager->mutex);
+
+  if (mode == LATCH_SHARED) {
+    pthread_rwlock_rdlock(&frame->latch);
+  } else {
+    pthread_rwlock_wrlock(&frame->latch);
+  }
+  return frame->page;
+}
+
+/*
+Like latch_page(), but gives up instead of waiting. Returns NULL,
+with the page left unpinned, if another thread holds the latch.
+*/
+void* try_latch_page(Pager* pager, uint32_t page_num, LatchMode mode) {
+  pthread_mutex_lock(&pager->mutex);
+  Frame* frame = pager_pin(pager, page_num);
+  pthread_mutex_unlock(&pager->mutex);
+
+  int result = (mode == LATCH_SHARED) ? pthread_rwlock_tryrdlock(&frame->latch)
+                                      : pthread_rwlock_trywrlock(&frame->latch);
+  if (result != 0) {
+    unpin_page(pager, page_num, false);
+    return NULL;
+  }
+  return frame->page;
+}
+
+/* Release a latch taken with latch_page(), and its pin */
+void unlatch_page(Pager* pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->mutex);
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame == NULL || frame->pin_count == 0) {
+    printf("Tried to unlatch page %d that is not pinned\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  pthread_rwlock_unlock(&frame->latch);
+  frame->pin_count--;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+Tell the kernel how the mapping is about to be read, so a scan gets
+aggressive readahead and point lookups do not fault in neighbours.
+*/
+void pager_advise(Pager* pager, int advice) {
+  if (pager->map == NULL ||
+      __atomic_load_n(&pager->map_advice, __ATOMIC_RELAXED) == advice) {
+    return;
+  }
+  pthread_mutex_lock(&pager->mutex);
+  if (pager->map_advice != advice) {
+    madvise(pager->map, (size_t)pager->map_num_pages * PAGE_SIZE, advice);
+    __atomic_store_n(&pager->map_advice, advice, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+bool readahead_request_pending(Readahead* readahead) {
+  pthread_mutex_lock(&readahead->mutex);
+  bool pending = readahead->request_page_num != INVALID_PAGE_NUM ||
+                 readahead->stop;
+  pthread_mutex_unlock(&readahead->mutex);
+  return pending;
+}
+
+bool readahead_read(Readahead* readahead, uint32_t page_num) {
+  ssize_t bytes_read = pread(readahead->file_descriptor, readahead->page,
+                             PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+  if (bytes_read > 0) {
+    stats_add(readahead->counters, STAT_BYTES_READ, bytes_read);
+  }
+  return bytes_read == PAGE_SIZE;
+}
+
+uint32_t readahead_walk(Readahead* readahead, uint32_t page_num,
+                        uint32_t depth, NextPageFunction next_page,
+                        uint64_t bound) {
+  /*
+  Make sure depth pages past page_num are read. If the scan is still
+  inside the chain walked last time, only the part past its end is
+  read. Otherwise the walk starts over at page_num.
+  */
+  uint32_t start = readahead->chain_length;
+  for (uint32_t i = 0; i < readahead->chain_length; i++) {
+    if (readahead->chain[i] == page_num) {
+      start = i;
+      break;
+    }
+  }
+  if (start == readahead->chain_length) {
+    readahead->chain[0] = page_num;
+    readahead->chain_length = 1;
+    readahead->chain_next = INVALID_PAGE_NUM;
+  } else {
+    readahead->chain_length -= start;
+    memmove(readahead->chain, readahead->chain + start,
+            readahead->chain_length * sizeof(uint32_t));
+  }
+
+  uint32_t num_read = 0;
+  while (readahead->chain_length <= depth &&
+         !readahead_request_pending(readahead)) {
+    uint32_t next_page_num = readahead->chain_next;
+    if (next_page_num == INVALID_PAGE_NUM) {
+      uint32_t last = readahead->chain[readahead->chain_length - 1];
+      if (!readahead_read(readahead, last)) {
+        break;
+      }
+      next_page_num = next_page(readahead->page, bound);
+    }
+    if (next_page_num == 0 || !readahead_read(readahead, next_page_num)) {
+      break;
+    }
+
+    num_read++;
+    readahead->chain[readahead->chain_length++] = next_page_num;
+    readahead->chain_next = next_page(readahead->page, bound);
+  }
+  return num_read;
+}
+
+void* readahead_thread_main(void* argument) {
+  Readahead* readahead = argument;
+
+  pthread_mutex_lock(&readahead->mutex);
+  while (!readahead->stop) {
+    if (readahead->request_page_num == INVALID_PAGE_NUM) {
+      pthread_cond_wait(&readahead->cond, &readahead->mutex);
+      continue;
+    }
+
+    uint32_t page_num = readahead->request_page_num;
+    uint32_t depth = readahead->request_depth;
+    uint64_t bound = readahead->request_bound;
+    NextPageFunction next_page = readahead->next_page;
+    readahead->request_page_num = INVALID_PAGE_NUM;
+    pthread_mutex_unlock(&readahead->mutex);
+
+    uint32_t num_read =
+        readahead_walk(readahead, page_num, depth, next_page, bound);
+
+    pthread_mutex_lock(&readahead->mutex);
+    readahead->pages_read += num_read;
+  }
+  pthread_mutex_unlock(&readahead->mutex);
+
+  return NULL;
+}
+
+void readahead_open(Pager* pager, uint32_t max_pages) {
+  Readahead* readahead = &pager->readahead;
+  readahead->max_pages = max_pages;
+  readahead->file_descriptor = pager->file_descriptor;
+  readahead->pages_read = 0;
+  if (max_pages == 0) {
+    return;
+  }
+
+  readahead->chain = malloc((max_pages + 1) * sizeof(uint32_t));
+  readahead->chain_length = 0;
+  readahead->chain_next = INVALID_PAGE_NUM;
+  readahead->page = malloc(PAGE_SIZE);
+  readahead->counters = pager->counters;
+  readahead->request_page_num = INVALID_PAGE_NUM;
+  readahead->request_depth = 0;
+  readahead->request_bound = 0;
+  readahead->next_page = NULL;
+  readahead->stop = false;
+  pthread_mutex_init(&readahead->mutex, NULL);
+  pthread_cond_init(&readahead->cond, NULL);
+  pthread_create(&readahead->thread, NULL, readahead_thread_main, readahead);
+}
+
+void readahead_close(Pager* pager) {
+  Readahead* readahead = &pager->readahead;
+  if (readahead->max_pages == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&readahead->mutex);
+  readahead->stop = true;
+  pthread_cond_signal(&readahead->cond);
+  pthread_mutex_unlock(&readahead->mutex);
+  pthread_join(readahead->thread, NULL);
+
+  pthread_mutex_destroy(&readahead->mutex);
+  pthread_cond_destroy(&readahead->cond);
+  free(readahead->page);
+  free(readahead->chain);
+}
+
+/*
+Ask the readahead thread to have the depth pages that follow page_num
+in its chain read. Returns at once. A newer request replaces one the
+thread has not started yet.
+*/
+void pager_readahead(Pager* pager, uint32_t page_num, uint32_t depth,
+                     NextPageFunction next_page, uint64_t bound) {
+  Readahead* readahead = &pager->readahead;
+  if (readahead->max_pages == 0) {
+    return;
+  }
+  if (depth > readahead->max_pages) {
+    depth = readahead->max_pages;
+  }
+
+  pthread_mutex_lock(&readahead->mutex);
+  readahead->request_page_num = page_num;
+  readahead->request_depth = depth;
+  readahead->request_bound = bound;
+  readahead->next_page = next_page;
+  pthread_cond_signal(&readahead->cond);
+  pthread_mutex_unlock(&readahead->mutex);
+}
+
+void unpin_page(Pager* pager, uint32_t page_num, bool is_dirty) {
+  pthread_mutex_lock(&pager->mutex);
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame == NULL || frame->pin_count == 0) {
+    printf("Tried to unpin page %d that is not pinned\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  frame->pin_count--;
+  if (is_dirty) {
+    pager_mark_dirty(pager, frame);
+  }
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+void print_cache_stats(Pager* pager) {
+  pthread_mutex_lock(&pager->mutex);
+  uint32_t num_pinned = 0;
+  for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+    if (pager->frames[i].pin_count > 0) {
+      num_pinned++;
+    }
+  }
+  printf("frames: %d (used %d, pinned %d)\n", pager->num_frames,
+         pager->num_frames_used, num_pinned);
+  printf("hits: %lu\n", pager->stats.hits);
+  printf("misses: %lu\n", pager->stats.misses);
+  printf("evictions: %lu\n", pager->stats.evictions);
+  printf("writebacks: %lu\n", pager->stats.writebacks);
+  printf("wal: %lu pages in %lu bytes\n", pager->stats.wal_pages,
+         pager->stats.wal_bytes);
+  printf("mmap: %d pages\n", pager->map_num_pages);
+  pthread_mutex_unlock(&pager->mutex);
+
+  uint64_t pages_read = 0;
+  if (pager->readahead.max_pages > 0) {
+    pthread_mutex_lock(&pager->readahead.mutex);
+    pages_read = pager->readahead.pages_read;
+    pthread_mutex_unlock(&pager->readahead.mutex);
+  }
+  printf("readahead: %lu pages\n", pages_read);
+}
+
+/*
+Reuse a free page if there is one. Otherwise the new page goes onto
+the end of the database file. Either way the caller has to initialize
+the page, since a reused page still holds whatever it held before.
+*/
+uint32_t get_unused_page_num(Pager* pager) {
+  FileHeader* header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t trunk_page_num = header->freelist_trunk_page_num;
+  if (trunk_page_num == 0) {
+    unpin_page(pager, HEADER_PAGE_NUM, false);
+    pthread_mutex_lock(&pager->mutex);
+    uint32_t page_num = pager->num_pages;
+    pthread_mutex_unlock(&pager->mutex);
+    return page_num;
+  }
+
+  uint32_t page_num;
+  FreelistTrunk* trunk = get_page(pager, trunk_page_num);
+  if (trunk->num_leaves > 0) {
+    trunk->num_leaves--;
+    page_num = trunk->leaves[trunk->num_leaves];
+    unpin_page(pager, trunk_page_num, true);
+  } else {
+    /* An empty trunk is handed out itself */
+    page_num = trunk_page_num;
+    header->freelist_trunk_page_num = trunk->next_trunk_page_num;
+    unpin_page(pager, trunk_page_num, false);
+  }
+  header->num_free_pages--;
+  unpin_page(pager, HEADER_PAGE_NUM, true);
+
+  return page_num;
+}
+
+void pager_free_page(Pager* pager, uint32_t page_num) {
+  FileHeader* header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t trunk_page_num = header->freelist_trunk_page_num;
+
+  bool added = false;
+  if (trunk_page_num != 0) {
+    FreelistTrunk* trunk = get_page(pager, trunk_page_num);
+    if (trunk->num_leaves < FREELIST_TRUNK_MAX_LEAVES) {
+      trunk->leaves[trunk->num_leaves] = page_num;
+      trunk->num_leaves++;
+      added = true;
+    }
+    unpin_page(pager, trunk_page_num, added);
+  }
+
+  if (!added) {
+    /* The first trunk is full. The freed page becomes the new first trunk. */
+    FreelistTrunk* trunk = get_page(pager, page_num);
+    trunk->next_trunk_page_num = trunk_page_num;
+    trunk->num_leaves = 0;
+    unpin_page(pager, page_num, true);
+    header->freelist_trunk_page_num = page_num;
+  }
+  header->num_free_pages++;
+  unpin_page(pager, HEADER_PAGE_NUM, true);
+}
+
+int compare_page_nums(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+Empty the freelist. Returns every page that was on it, trunks
+included, sorted by page number. The caller owns the array.
+*/
+uint32_t* pager_take_free_pages(Pager* pager, uint32_t* num_free_pages) {
+  FileHeader* header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t* pages = malloc((header->num_free_pages + 1) * sizeof(uint32_t));
+  uint32_t num_pages = 0;
+
+  uint32_t trunk_page_num = header->freelist_trunk_page_num;
+  while (trunk_page_num != 0) {
+    FreelistTrunk* trunk = get_page(pager, trunk_page_num);
+    for (uint32_t i = 0; i < trunk->num_leaves; i++) {
+      pages[num_pages++] = trunk->leaves[i];
+    }
+    pages[num_pages++] = trunk_page_num;
+    uint32_t next_trunk_page_num = trunk->next_trunk_page_num;
+    unpin_page(pager, trunk_page_num, false);
+    trunk_page_num = next_trunk_page_num;
+  }
+
+  header->freelist_trunk_page_num = 0;
+  header->num_free_pages = 0;
+  unpin_page(pager, HEADER_PAGE_NUM, true);
+
+  qsort(pages, num_pages, sizeof(uint32_t), compare_page_nums);
+  *num_free_pages = num_pages;
+  return pages;
+}
+
+/*
+Shrink the database to num_pages. Pages past the end must no longer
+be referenced. Their frames are dropped, and the db file itself is
+cut down by the checkpoint that folds in the commit.
+*/
+void pager_truncate(Pager* pager, uint32_t num_pages) {
+  pthread_mutex_lock(&pager->mutex);
+  for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+    Frame* frame = &pager->frames[i];
+    if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < num_pages) {
+      continue;
+    }
+    if (frame->pin_count > 0) {
+      printf("Tried to truncate pinned page %d\n", frame->page_num);
+      exit(EXIT_FAILURE);
+    }
+    pager_drop_frame(pager, frame);
+  }
+
+  if (num_pages < pager->map_num_pages) {
+    // Touching the mapping past the end of the file would SIGBUS
+    munmap(pager->map + (size_t)num_pages * PAGE_SIZE,
+           (size_t)(pager->map_num_pages - num_pages) * PAGE_SIZE);
+    pager->map_num_pages = num_pages;
+    if (num_pages == 0) {
+      pager->map = NULL;
+    }
+  }
+  pager->num_pages = num_pages;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+Pager* pager_open(const char* filename, DbOptions* options) {
+  int fd = open(filename,
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Pager* pager = malloc(sizeof(Pager));
+  pthread_mutex_init(&pager->mutex, NULL);
+  pager->file_descriptor = fd;
+  pager->counters = stats_new();
+
+  // Replays whatever a crash left in the WAL before the file is sized
+  wal_open(pager, filename, options);
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  pager->num_pages = (file_length / PAGE_SIZE);
+
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Db file is not a whole number of pages. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->committed_num_pages = pager->num_pages;
+
+  uint32_t cache_pages = options->cache_pages;
+  if (cache_pages < PAGER_MIN_CACHE_PAGES) {
+    cache_pages = PAGER_MIN_CACHE_PAGES;
+  }
+  pager->num_frames = cache_pages;
+  pager->num_frames_used = 0;
+  pager->clock_hand = 0;
+  pager->frames = malloc(cache_pages * sizeof(Frame));
+  /*
+  The frames' buffers are slices of one anonymous mapping, so they are
+  page-aligned, and take up memory only once a frame is first used.
+  */
+  pager->frame_slab = mmap(NULL, (size_t)cache_pages * PAGE_SIZE,
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+  if (pager->frame_slab == MAP_FAILED) {
+    printf("Error allocating frames: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  /*
+  A steady stream of readers would otherwise keep the writer off the
+  root forever. Readers only wait for latches on the way down, the
+  same order the writer takes them in, so favouring the writer cannot
+  deadlock.
+  */
+  pthread_rwlockattr_t latch_attr;
+  pthread_rwlockattr_init(&latch_attr);
+  pthread_rwlockattr_setkind_np(&latch_attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  for (uint32_t i = 0; i < cache_pages; i++) {
+    pager->frames[i].page = NULL;
+    pager->frames[i].buffer = pager->frame_slab + (size_t)i * PAGE_SIZE;
+    pager->frames[i].page_num = INVALID_PAGE_NUM;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].dirty = false;
+    pager->frames[i].in_txn = false;
+    pager->frames[i].referenced = false;
+    pager->frames[i].mapped = false;
+    pager->frames[i].copied = false;
+    pthread_rwlock_init(&pager->frames[i].latch, &latch_attr);
+  }
+  pthread_rwlockattr_destroy(&latch_attr);
+
+  pager->page_table_size = pager->num_pages > 0 ? pager->num_pages : 1;
+  pager->page_table = malloc(pager->page_table_size * sizeof(uint32_t));
+  for (uint32_t i = 0; i < pager->page_table_size; i++) {
+    pager->page_table[i] = INVALID_FRAME;
+  }
+
+  pager->txn_pages = NULL;
+  pager->num_txn_pages = 0;
+  pager->txn_pages_capacity = 0;
+  pager->txn_spilled = false;
+  pager->commit_scratch = NULL;
+  pager->commit_scratch_size = 0;
+
+  memset(&pager->stats, 0, sizeof(PagerStats));
+
+  // Pages appended later are past the end of the mapping and take
+  // the pread() path, so the mapping never has to grow.
+  pager->map = NULL;
+  pager->map_num_pages = 0;
+  pager->map_advice = MADV_NORMAL;
+  if (options->use_mmap && pager->num_pages > 0) {
+    void* map = mmap(NULL, (size_t)pager->num_pages * PAGE_SIZE,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      printf("Error mapping db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->map = map;
+    pager->map_num_pages = pager->num_pages;
+  }
+
+  readahead_open(pager, options->readahead_pages);
+
+  bool is_new = (pager->num_pages == 0);
+  FileHeader* header = get_page(pager, HEADER_PAGE_NUM);
+  if (is_new) {
+    header->magic = HEADER_MAGIC;
+    header->root_page_num = 0;  // the tree sets this up
+    header->freelist_trunk_page_num = 0;
+    header->num_free_pages = 0;
+  } else if (header->magic != HEADER_MAGIC) {
+    printf("Db file has no valid header page. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  unpin_page(pager, HEADER_PAGE_NUM, is_new);
+
+  return pager;
+}
+
+void pager_close(Pager* pager) {
+  readahead_close(pager);
+  pager_commit(pager);
+  wal_close(pager);
+
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pthread_rwlock_destroy(&pager->frames[i].latch);
+  }
+  munmap(pager->frame_slab, (size_t)pager->num_frames * PAGE_SIZE);
+  if (pager->map != NULL) {
+    munmap(pager->map, (size_t)pager->map_num_pages * PAGE_SIZE);
+  }
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  free(pager->frames);
+  free(pager->page_table);
+  free(pager->txn_pages);
+  free(pager->commit_scratch);
+  free(pager->counters);
+  pthread_mutex_destroy(&pager->mutex);
+  free(pager);
+}
@@ -0,0 +1,288 @@
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "libdb.h"
+#include "stats.h"
+
+#define PAGE_SIZE 4096
+#define PAGER_DEFAULT_CACHE_PAGES 100
+/* Enough frames for every page pinned at once during a split */
+#define PAGER_MIN_CACHE_PAGES 8
+#define PAGER_DEFAULT_READAHEAD_PAGES 64
+/* Most commit working memory kept for the next commit, in bytes */
+#define PAGER_MAX_KEPT_SCRATCH (1 << 20)
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+
+/*
+ * The last four bytes of every page hold a CRC32C of the rest of it.
+ * The pager sets it whenever it writes a page out and checks it
+ * whenever it reads one in, so the layouts built on top of it only
+ * have PAGE_USABLE_SIZE bytes to work with.
+ */
+#define PAGE_CHECKSUM_SIZE sizeof(uint32_t)
+#define PAGE_USABLE_SIZE (PAGE_SIZE - PAGE_CHECKSUM_SIZE)
+
+/*
+ * Page 0 is the file header. It records where the root of the table's
+ * tree and of each index tree is, and where the list of free pages
+ * starts.
+ *
+ * Free pages are kept in trunk pages chained off the header. Each
+ * trunk lists up to FREELIST_TRUNK_MAX_LEAVES free pages, and is itself
+ * handed out once its list is empty. The header and the trunks are
+ * ordinary pages, so freelist changes go through the WAL and commit or
+ * roll back with the rest of the transaction.
+ */
+#define HEADER_PAGE_NUM 0
+#define HEADER_MAGIC 0x64623131
+
+typedef struct {
+  uint32_t magic;
+  uint32_t root_page_num;
+  uint32_t freelist_trunk_page_num;  // 0 if there are no free pages
+  uint32_t num_free_pages;           // trunks included
+  /* Roots of the secondary indexes by DbColumn, 0 where there is none */
+  uint32_t index_root_page_nums[DB_NUM_INDEXED_COLUMNS];
+} FileHeader;
+
+typedef struct {
+  uint32_t next_trunk_page_num;  // 0 on the last trunk
+  uint32_t num_leaves;
+  uint32_t leaves[];
+} FreelistTrunk;
+
+#define FREELIST_TRUNK_MAX_LEAVES \
+  ((PAGE_USABLE_SIZE - sizeof(FreelistTrunk)) / sizeof(uint32_t))
+
+/*
+ * A frame is one slot of the buffer pool. It holds at most one page
+ * and cannot be evicted while pin_count is non-zero.
+ *
+ * The latch guards the page's contents between threads. Readers latch
+ * a page shared and the writer exclusive. A page is latched only while
+ * it is pinned, so the latch always belongs to the page in the frame.
+ */
+typedef enum { LATCH_SHARED, LATCH_EXCLUSIVE } LatchMode;
+
+typedef struct {
+  void* page;    // either buffer or the page's slot in pager->map
+  void* buffer;  // the frame's own page in pager->frame_slab
+  pthread_rwlock_t latch;
+  uint32_t page_num;  // INVALID_PAGE_NUM if the frame is empty
+  uint32_t pin_count;
+  bool dirty;       // newer than the copy in the WAL or db file
+  bool in_txn;      // already listed in pager->txn_pages
+  bool referenced;  // CLOCK reference bit, set on every access
+  bool mapped;      // page points into pager->map
+  bool copied;      // a write gave the mapped page a private copy
+} Frame;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;
+  uint64_t wal_pages;  // page images appended to the WAL
+  uint64_t wal_bytes;  // and their size
+} PagerStats;
+
+/*
+ * Write-ahead log. Changed pages are appended to <db>-wal as whole-page
+ * records, and the last record of each transaction carries a commit
+ * mark. Reads of a page that is in the log are served from its newest
+ * record, so the db file itself is only written by checkpoints.
+ *
+ * WAL file layout:
+ *   header: magic, salt
+ *   record: WalRecordHeader, then image_size bytes of page image. A
+ *           bare commit record (page_num == INVALID_PAGE_NUM) has none.
+ *
+ * With compress_wal set, a page image is the page compressed by
+ * page_compress() whenever that is smaller, and image_size is under
+ * PAGE_SIZE. The db file and the buffer pool always hold whole pages.
+ *
+ * Every record of a page stays in the log until the log restarts, so
+ * the log also holds the page's older versions. A snapshot is a
+ * position in the log, counted across restarts. Reading a page at a
+ * snapshot finds its newest record before that position, or else the
+ * copy in the db file. Checkpoints never fold in records past the
+ * oldest open snapshot, and the log only restarts once no snapshot
+ * needs it, which is when the old versions are dropped.
+ */
+typedef uint64_t Snapshot;
+
+#define WAL_MAGIC 0x57414c32
+#define WAL_HEADER_SIZE (2 * sizeof(uint32_t))
+#define WAL_AUTOCHECKPOINT_PAGES 1000
+/* Longest run of consecutive pages a checkpoint writes with one call */
+#define CHECKPOINT_MAX_RUN_PAGES 64
+#define WAL_MAX_IOVECS 1024  // IOV_MAX on Linux
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t commit_num_pages;  // database size on a commit record, else 0
+  uint32_t salt;              // must match the WAL header
+  uint32_t image_size;        // PAGE_SIZE unless compressed, 0 if bare
+  uint32_t checksum;
+} WalRecordHeader;
+
+#define WAL_NO_VERSION UINT32_MAX
+
+typedef struct {
+  off_t offset;
+  uint32_t previous;  // older record of the same page, or WAL_NO_VERSION
+} WalVersion;
+
+typedef struct {
+  int file_descriptor;
+  char* filename;
+  uint32_t salt;
+  off_t length;               // end of the last record
+  off_t committed_length;     // end of the last commit record
+  off_t synced_length;        // prefix known to be on stable storage
+  off_t checkpointed_length;  // prefix already folded into the db file
+  /*
+  The records of each page, newest first: index[page_num] is the
+  newest in versions, WAL_NO_VERSION if there is none, and each one
+  links to the one before it.
+  */
+  uint32_t* index;
+  uint32_t index_size;
+  WalVersion* versions;
+  uint32_t num_versions;
+  uint32_t versions_capacity;
+  uint64_t generation_start;  // snapshot position of offset 0 in the file
+  uint32_t commit_interval_ms;
+  bool async_commit;  // commits return before their sync
+  bool compress;
+  Stats* counters;  // the pager's
+  struct timespec oldest_unsynced_commit;
+  /*
+  The background thread syncs batched commits and runs checkpoints.
+  It only reads the log and writes the db file, so the fields above
+  that it shares with the main thread are guarded by mutex.
+  */
+  bool checkpoint_running;
+  bool stop;
+  Snapshot* snapshots;  // open snapshots, unordered
+  uint32_t num_snapshots;
+  uint32_t snapshots_capacity;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} Wal;
+
+/*
+ * Leaf readahead. A scan hands the pager the leaf it just entered, and
+ * a background thread walks the sibling chain from there, reading the
+ * next pages into the OS page cache. By the time the scan reaches them
+ * the buffer pool misses are served from memory instead of the disk.
+ *
+ * The pager does not know the node layout, so the caller passes a
+ * function that returns the page after a given page, or 0 where the
+ * walk should stop. bound is passed through to it unchanged, which
+ * lets a range scan stop the walk at the end of its range.
+ * The thread only ever reads the db file, so a stale link (a page whose
+ * newest copy is in the WAL or the buffer pool) costs a wasted read,
+ * never a wrong result.
+ */
+typedef uint32_t (*NextPageFunction)(void* page, uint64_t bound);
+
+typedef struct {
+  uint32_t max_pages;  // 0 if readahead is off
+  int file_descriptor;
+  /*
+  The pages walked so far, in chain order. chain[0] is the leaf the
+  scan was last reported at, and the rest are already read ahead.
+  */
+  uint32_t* chain;
+  uint32_t chain_length;
+  uint32_t chain_next;  // page after the last one, INVALID_PAGE_NUM if unread
+  void* page;           // the thread's read buffer
+  Stats* counters;      // the pager's
+  /* Guarded by mutex */
+  uint64_t pages_read;
+  uint32_t request_page_num;  // INVALID_PAGE_NUM if there is none
+  uint32_t request_depth;
+  uint64_t request_bound;
+  NextPageFunction next_page;
+  bool stop;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} Readahead;
+
+typedef struct {
+  /*
+  Guards the frames, the page table, the open transaction and the
+  stats. The WAL and readahead threads keep their own mutexes. It is
+  held for lookups and misses, never while a thread waits for a latch.
+  */
+  pthread_mutex_t mutex;
+  int file_descriptor;
+  uint32_t num_pages;
+  uint32_t committed_num_pages;  // num_pages as of the last commit
+  Frame* frames;
+  void* frame_slab;  // num_frames page-aligned buffers, one per frame
+  uint32_t num_frames;
+  uint32_t num_frames_used;
+  uint32_t clock_hand;
+  uint32_t* page_table;  // page_num -> frame index, or INVALID_FRAME
+  uint32_t page_table_size;
+  uint32_t* txn_pages;  // pages dirtied since the last commit
+  uint32_t num_txn_pages;
+  uint32_t txn_pages_capacity;
+  bool txn_spilled;  // some of them were evicted into the WAL already
+  void* commit_scratch;  // pager_commit()'s working memory
+  size_t commit_scratch_size;
+  Wal wal;
+  Readahead readahead;
+  PagerStats stats;
+  Stats* counters;  // for db_stats(), updated without mutex
+  /*
+  With DbOptions.use_mmap the db file is mapped MAP_PRIVATE, and a
+  frame loaded from it points straight into the mapping instead of
+  copying the page. Writes to a mapped page only touch a private copy,
+  so the db file is still written by checkpoints alone. Pages the
+  mapping does not cover (logged in the WAL, or appended after open)
+  are read into the frame's buffer as usual.
+  */
+  void* map;
+  uint32_t map_num_pages;
+  int map_advice;  // last madvise() hint given for the mapping
+} Pager;
+
+Pager* pager_open(const char* filename, DbOptions* options);
+void pager_close(Pager* pager);
+void* get_page(Pager* pager, uint32_t page_num);
+void unpin_page(Pager* pager, uint32_t page_num, bool is_dirty);
+Snapshot pager_snapshot_begin(Pager* pager);
+void pager_snapshot_end(Pager* pager, Snapshot snapshot);
+void pager_read_snapshot(Pager* pager, Snapshot snapshot, uint32_t page_num,
+                         void* page);
+bool pager_try_read_snapshot(Pager* pager, Snapshot snapshot,
+                             uint32_t page_num, void* page);
+void* latch_page(Pager* pager, uint32_t page_num, LatchMode mode);
+void* try_latch_page(Pager* pager, uint32_t page_num, LatchMode mode);
+void unlatch_page(Pager* pager, uint32_t page_num);
+uint32_t get_unused_page_num(Pager* pager);
+void pager_free_page(Pager* pager, uint32_t page_num);
+uint32_t* pager_take_free_pages(Pager* pager, uint32_t* num_free_pages);
+void pager_truncate(Pager* pager, uint32_t num_pages);
+Snapshot pager_commit(Pager* pager);
+void pager_wait_synced(Pager* pager, Snapshot position);
+void pager_rollback(Pager* pager);
+void pager_advise(Pager* pager, int advice);
+void pager_readahead(Pager* pager, uint32_t page_num, uint32_t depth,
+                     NextPageFunction next_page, uint64_t bound);
+void print_cache_stats(Pager* pager);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Readers against a writer that keeps growing the tree and shrinking it
+ * back. Every round the writer inserts rows around a few stable ones,
+ * splitting leaves and internal nodes, then deletes them again, some
+ * one at a time and some by range, until merges have collapsed the root
+ * back into a single leaf. The rounds are small, so the root moves often.
+ * Meanwhile the readers look up rows, by id and through an index, with
+ * latches, and scan them at a snapshot. They must always find every
+ * stable row, never a torn one, and scans must come back in order. The
+ * cache is small, so pages are evicted and read back under the readers.
+ *
+ *   concurrent_readers <db file>
+ *
+ * Prints "ok" and the database's problem count once the writer is done.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../libdb.h"
+
+#define CONCURRENT_READERS_THREADS 2
+#define CONCURRENT_READERS_ROUNDS 100
+#define CONCURRENT_READERS_CACHE_PAGES 32
+/* Ids that are multiples of this are stable, the rest are churned */
+#define CONCURRENT_READERS_STRIDE 16
+#define CONCURRENT_READERS_STABLE_ROWS 8
+#define CONCURRENT_READERS_MAX_ID \
+  (CONCURRENT_READERS_STRIDE * CONCURRENT_READERS_STABLE_ROWS)
+
+typedef struct {
+  Table* table;
+  uint32_t seed;
+  volatile bool* stop;
+  bool failed;
+} Reader;
+
+/* Rows of varied length, so leaves split at different counts */
+void make_row(Row* row, uint32_t id) {
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u", id);
+  uint32_t email_length = id * 7 % 200 + 10;
+  memset(row->email, 'a' + id % 26, email_length);
+  row->email[email_length] = '\0';
+}
+
+bool row_intact(const Row* row) {
+  Row expected;
+  make_row(&expected, row->id);
+  return strcmp(row->username, expected.username) == 0 &&
+         strcmp(row->email, expected.email) == 0;
+}
+
+bool is_stable(uint32_t id) { return id % CONCURRENT_READERS_STRIDE == 0; }
+
+void reader_lookup(Reader* reader) {
+  Row row;
+  uint32_t id = rand_r(&reader->seed) % CONCURRENT_READERS_MAX_ID + 1;
+  DbResult result = db_get(reader->table, id, &row);
+  if (result == DB_SUCCESS && (row.id != id || !row_intact(&row))) {
+    printf("Lookup of %u found a torn row %u.\n", id, row.id);
+    reader->failed = true;
+  } else if (result != DB_SUCCESS && is_stable(id)) {
+    printf("Lookup lost stable row %u.\n", id);
+    reader->failed = true;
+  }
+}
+
+void reader_scan(Reader* reader) {
+  uint32_t first_id = rand_r(&reader->seed) % CONCURRENT_READERS_MAX_ID + 1;
+  uint32_t last_id =
+      first_id + rand_r(&reader->seed) % (CONCURRENT_READERS_STRIDE * 3);
+  uint32_t num_stable = 0;
+  uint32_t previous_id = 0;
+  Row row;
+  Cursor* cursor = db_cursor_open_range(reader->table, first_id, last_id);
+  while (db_cursor_next(cursor, &row)) {
+    if (row.id < first_id || row.id > last_id || row.id <= previous_id ||
+        !row_intact(&row)) {
+      printf("Scan of %u..%u found %u after %u.\n", first_id, last_id,
+             row.id, previous_id);
+      reader->failed = true;
+    }
+    previous_id = row.id;
+    num_stable += is_stable(row.id);
+  }
+  db_cursor_close(cursor);
+
+  uint32_t expected = 0;
+  for (uint32_t id = first_id; id <= last_id; id++) {
+    expected += is_stable(id) && id <= CONCURRENT_READERS_MAX_ID;
+  }
+  if (num_stable != expected) {
+    printf("Scan of %u..%u found %u stable rows, not %u.\n", first_id,
+           last_id, num_stable, expected);
+    reader->failed = true;
+  }
+}
+
+void reader_find(Reader* reader) {
+  uint32_t id = (rand_r(&reader->seed) % CONCURRENT_READERS_STABLE_ROWS + 1) *
+                CONCURRENT_READERS_STRIDE;
+  Row expected;
+  make_row(&expected, id);
+  Row row;
+  if (db_find(reader->table, DB_COLUMN_USERNAME, expected.username, &row, 1) !=
+          1 ||
+      row.id != id) {
+    printf("Index lost stable row %u.\n", id);
+    reader->failed = true;
+  }
+}
+
+void* reader_main(void* argument) {
+  Reader* reader = argument;
+  while (!*reader->stop && !reader->failed) {
+    uint32_t choice = rand_r(&reader->seed) % 16;
+    if (choice == 0) {
+      reader_scan(reader);
+    } else if (choice == 1) {
+      reader_find(reader);
+    } else {
+      reader_lookup(reader);
+    }
+  }
+  return NULL;
+}
+
+void shuffle(uint32_t* ids, uint32_t num_ids, uint32_t* seed) {
+  for (uint32_t i = num_ids - 1; i > 0; i--) {
+    uint32_t j = rand_r(seed) % (i + 1);
+    uint32_t id = ids[i];
+    ids[i] = ids[j];
+    ids[j] = id;
+  }
+}
+
+/* Grow the tree around the stable rows, then delete back down to them */
+bool writer_round(Table* table, uint32_t* seed) {
+  static uint32_t ids[CONCURRENT_READERS_MAX_ID];
+  uint32_t num_ids = 0;
+  for (uint32_t id = 1; id <= CONCURRENT_READERS_MAX_ID; id++) {
+    if (!is_stable(id)) {
+      ids[num_ids++] = id;
+    }
+  }
+  shuffle(ids, num_ids, seed);
+  Row row;
+  for (uint32_t i = 0; i < num_ids; i++) {
+    make_row(&row, ids[i]);
+    db_insert(table, &row);
+  }
+  DbStats stats;
+  db_stats(table, &stats);
+  if (stats.tree_height < 2) {
+    printf("The tree did not grow.\n");
+    return false;
+  }
+
+  /* The first half of the gaps between stable rows goes by range */
+  for (uint32_t id = 0; id < CONCURRENT_READERS_MAX_ID / 2;
+       id += CONCURRENT_READERS_STRIDE) {
+    db_delete_range(table, id + 1, id + CONCURRENT_READERS_STRIDE - 1);
+  }
+  shuffle(ids, num_ids, seed);
+  for (uint32_t i = 0; i < num_ids; i++) {
+    if (ids[i] > CONCURRENT_READERS_MAX_ID / 2) {
+      db_delete(table, ids[i]);
+    }
+  }
+  db_stats(table, &stats);
+  if (stats.tree_height != 1) {
+    printf("The root did not collapse, the tree is %u high.\n",
+           stats.tree_height);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Only the readers are under test, so commits need not wait for syncs */
+  DbOptions options = default_db_options();
+  options.cache_pages = CONCURRENT_READERS_CACHE_PAGES;
+  options.async_commit = true;
+  Table* table = db_open(argv[1], &options);
+  Row row;
+  for (uint32_t i = 1; i <= CONCURRENT_READERS_STABLE_ROWS; i++) {
+    make_row(&row, i * CONCURRENT_READERS_STRIDE);
+    db_insert(table, &row);
+  }
+  db_create_index(table, DB_COLUMN_USERNAME);
+
+  volatile bool stop = false;
+  Reader readers[CONCURRENT_READERS_THREADS];
+  pthread_t threads[CONCURRENT_READERS_THREADS];
+  for (uint32_t i = 0; i < CONCURRENT_READERS_THREADS; i++) {
+    readers[i] = (Reader){table, i + 1, &stop, false};
+    pthread_create(&threads[i], NULL, reader_main, &readers[i]);
+  }
+  uint32_t seed = 42;
+  bool failed = false;
+  for (uint32_t round = 0; round < CONCURRENT_READERS_ROUNDS && !failed;
+       round++) {
+    failed = !writer_round(table, &seed);
+  }
+  stop = true;
+  for (uint32_t i = 0; i < CONCURRENT_READERS_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    failed = failed || readers[i].failed;
+  }
+
+  if (!failed) {
+    printf("ok\n");
+  }
+  printf("%u problems\n", db_check(table, 1));
+  db_close(table);
+  return 0;
+}
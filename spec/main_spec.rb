@@ -1,11 +1,20 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal load.txt`
   end
 
-  def run_script(commands)
+  # Rows padded to the largest size a row can have, 13 of which fill a leaf
+  def wide_row(i)
+    "#{i} #{"user#{i}".ljust(32, "_")} #{"person#{i}@example.com".ljust(255, "_")}"
+  end
+
+  def write_rows(ids, wide: false)
+    File.write("load.txt", ids.map { |i| (wide ? wide_row(i) : "#{i} user#{i} person#{i}@example.com") + "\n" }.join)
+  end
+
+  def run_script(commands, options = [])
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen(["./db", *options, "test.db"], "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -57,18 +66,77 @@ describe 'database' do
     ])
   end
 
-  it 'prints error message when table is full' do
-    script = (1..1401).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
+  it 'splits internal nodes once the root is full' do
+    # In descending order, since appends fill leaves and the root too slowly
+    script = 4000.downto(1).map do |i|
+      "insert #{wide_row(i)}"
     end
+    script << ".btree"
     script << ".exit"
     result = run_script(script)
-    expect(result.last(2)).to match_array([
-      "db > Executed.",
-      "db > Need to implement splitting internal node",
+
+    tree = result[4000...result.length].select { |line| line.include?("internal") }
+    expect(tree).to eq([
+      "- internal (size 1)",
+      "  - internal (size 314)",
+      "  - internal (size 255)",
+    ])
+  end
+
+  it 'leaves a leaf full when a row is appended past its end' do
+    script = (1..14).map do |i|
+      "insert #{wide_row(i)}"
+    end
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    tree = result[14...result.length].reject { |line| line.start_with?("    - ") }
+    expect(tree).to eq([
+      "db > Tree:",
+      "- internal (size 1)",
+      "  - leaf (size 13)",
+      "  - key 13",
+      "  - leaf (size 1)",
+      "db > ",
     ])
   end
 
+  it 'splits a full internal node off the right edge evenly' do
+    # Bulk loading leaves the first internal node full, and 66185 lands in
+    # its last leaf, so the leaf's new sibling comes after all its children
+    write_rows((1..7000).map { |i| i * 10 }, wide: true)
+    result = run_script([".load load.txt", "insert #{wide_row(66185)}", ".btree", ".exit"])
+
+    tree = result.select { |line| line.include?("internal") }
+    expect(tree).to eq([
+      "- internal (size 2)",
+      "  - internal (size 254)",
+      "  - internal (size 255)",
+      "  - internal (size 28)",
+    ])
+  end
+
+  it 'keeps every row of a multi-level tree with a small cache' do
+    ids = (1..5000).to_a.shuffle(random: Random.new(42))
+    script = ids.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, ["--cache-pages=8"])
+
+    result = run_script(["select", ".exit"], ["--cache-pages=8"])
+    expected = (1..5000).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected[0] = "db > #{expected[0]}"
+    expect(result).to eq(expected + ["Executed.", "db > "])
+  end
+
+  it 'keeps rows visible to readers while a writer splits, merges and collapses the root' do
+    system("make", "-s", "spec/concurrent_readers", exception: true)
+    result = `./spec/concurrent_readers test.db`.split("\n")
+    expect(result).to eq(["ok", "0 problems"])
+  end
+
   it 'allows inserting strings that are the maximum length' do
     long_username = "a"*32
     long_email = "a"*255
@@ -102,6 +170,28 @@ describe 'database' do
     ])
   end
 
+  it 'parses insert fields separated by runs of spaces' do
+    script = [
+      "insert   7  user7   person7@example.com",
+      "insert 2147483647 last last@example.com",
+      "insert 4294967296 over over@example.com",
+      "insert 8 user8",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > (7, user7, person7@example.com)",
+      "(2147483647, last, last@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
   it 'prints an error message if id is negative' do
     script = [
       "insert -1 cstack foo@bar.com",
@@ -133,6 +223,193 @@ describe 'database' do
     ])
   end
 
+  it 'prints selects as csv' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 a,b say\"hi\"",
+      ".mode csv",
+      "select",
+      ".mode xml",
+      ".mode text",
+      "select where id = 2",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[2...result.length]).to eq([
+      "db > db > id,username,email",
+      "1,user1,person1@example.com",
+      "2,\"a,b\",\"say\"\"hi\"\"\"",
+      "Executed.",
+      "db > Usage: .mode text|csv|binary",
+      "db > db > (2, a,b, say\"hi\")",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'selects a range of ids' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id >= 12 and id < 16"
+    script << "select where id between 38 and 50"
+    script << "select where id = 7"
+    script << "select where id > 40"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[40...result.length]).to eq([
+      "db > (12, user12, person12@example.com)",
+      "(13, user13, person13@example.com)",
+      "(14, user14, person14@example.com)",
+      "(15, user15, person15@example.com)",
+      "Executed.",
+      "db > (38, user38, person38@example.com)",
+      "(39, user39, person39@example.com)",
+      "(40, user40, person40@example.com)",
+      "Executed.",
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'selects and deletes ids above INT32_MAX' do
+    result = run_script([
+      "insert 3000000000 user1 person1@example.com",
+      "insert 5 user5 person5@example.com",
+      "select where id = 3000000000",
+      "select where id >= 2147483648",
+      "select where id = 4294967296",
+      "delete where id = 3000000000",
+      "select",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > (3000000000, user1, person1@example.com)",
+      "Executed.",
+      "db > (3000000000, user1, person1@example.com)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Deleted 1 rows.",
+      "Executed.",
+      "db > (5, user5, person5@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'prints an error message for a malformed where clause' do
+    result = run_script([
+      "select where name = 3",
+      "select where id ~ 3",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'deletes rows by id and by range' do
+    script = (1..10).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "delete where id = 3"
+    script << "delete where id = 3"
+    script << "delete where id between 5 and 8"
+    script << "delete"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[10...result.length]).to eq([
+      "db > Deleted 1 rows.",
+      "Executed.",
+      "db > Deleted 0 rows.",
+      "Executed.",
+      "db > Deleted 4 rows.",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(4, user4, person4@example.com)",
+      "(9, user9, person9@example.com)",
+      "(10, user10, person10@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'borrows from and merges with siblings when deletes leave a leaf underfull' do
+    # Inserting 1 into the full leaf splits it evenly
+    script = [*2..14, 1, *15..20].map do |i|
+      "insert #{wide_row(i)}"
+    end
+    script << "delete where id <= 2"
+    script << ".btree"
+    script << "delete where id > 10"
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[20...result.length]).to eq([
+      "db > Deleted 2 rows.",
+      "Executed.",
+      "db > Tree:",
+      "- internal (size 1)",
+      "  - leaf (size 9)",
+      *(3..11).map { |i| "    - #{i}" },
+      "  - key 11",
+      "  - leaf (size 9)",
+      *(12..20).map { |i| "    - #{i}" },
+      "db > Deleted 10 rows.",
+      "Executed.",
+      "db > Tree:",
+      "- leaf (size 8)",
+      *(3..10).map { |i| "  - #{i}" },
+      "db > ",
+    ])
+  end
+
+  it 'packs short rows densely into a leaf' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[100]).to eq("db > Tree:")
+    expect(result[101]).to eq("- leaf (size 100)")
+  end
+
+  it 'keeps every row of a multi-level tree through deletes' do
+    script = (1..5000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "delete where id > 10 and id < 4990"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expected = ((1..10).to_a + (4990..5000).to_a).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expect(result[5000...result.length]).to eq([
+      "db > Deleted 4979 rows.",
+      "Executed.",
+      "db > #{expected.first}",
+      *expected.drop(1),
+      "Executed.",
+      "db > ",
+    ])
+  end
+
   it 'allows printing out the structure of a one-node btree' do
     script = [3, 1, 2].map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -155,11 +432,11 @@ describe 'database' do
   end
 
   it 'allows printing out the structure of a 3-leaf-node btree' do
-    script = (1..14).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
+    script = [*2..14, 1].map do |i|
+      "insert #{wide_row(i)}"
     end
     script << ".btree"
-    script << "insert 15 user15 person15@example.com"
+    script << "insert #{wide_row(15)}"
     script << ".exit"
     result = run_script(script)
 
@@ -190,36 +467,36 @@ describe 'database' do
 
   it 'allows printing out the structure of a 4-leaf-node btree' do
     script = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
+      "insert #{wide_row(18)}",
+      "insert #{wide_row(7)}",
+      "insert #{wide_row(10)}",
+      "insert #{wide_row(29)}",
+      "insert #{wide_row(23)}",
+      "insert #{wide_row(4)}",
+      "insert #{wide_row(14)}",
+      "insert #{wide_row(30)}",
+      "insert #{wide_row(15)}",
+      "insert #{wide_row(26)}",
+      "insert #{wide_row(22)}",
+      "insert #{wide_row(19)}",
+      "insert #{wide_row(2)}",
+      "insert #{wide_row(1)}",
+      "insert #{wide_row(21)}",
+      "insert #{wide_row(11)}",
+      "insert #{wide_row(6)}",
+      "insert #{wide_row(20)}",
+      "insert #{wide_row(5)}",
+      "insert #{wide_row(8)}",
+      "insert #{wide_row(9)}",
+      "insert #{wide_row(3)}",
+      "insert #{wide_row(12)}",
+      "insert #{wide_row(27)}",
+      "insert #{wide_row(17)}",
+      "insert #{wide_row(16)}",
+      "insert #{wide_row(13)}",
+      "insert #{wide_row(24)}",
+      "insert #{wide_row(25)}",
+      "insert #{wide_row(28)}",
       ".btree",
       ".exit",
     ]
@@ -278,12 +555,13 @@ describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
-      "ROW_SIZE: 293",
+      "ROW_MAX_SIZE: 293",
       "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
-      "LEAF_NODE_MAX_CELLS: 13",
+      "LEAF_NODE_HEADER_SIZE: 18",
+      "LEAF_NODE_SLOT_SIZE: 2",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4074",
+      "LEAF_NODE_MAX_CELLS: 509",
+      "INTERNAL_NODE_MAX_CELLS: 509",
       "db > ",
     ])
   end
@@ -315,4 +593,423 @@ describe 'database' do
       "Executed.", "db > ",
     ])
   end
+
+  it 'reports buffer pool counters' do
+    script = (1..3).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".cache"
+    script << ".exit"
+    result = run_script(script, ["--cache-pages=10"])
+
+    expect(result).to include(
+      "db > Cache:",
+      "frames: 10 (used 2, pinned 0)",
+      "misses: 2",
+      "evictions: 0",
+    )
+  end
+
+  it 'reports counters and latency histograms' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i} #{"a" * 250}#{i}"
+    end
+    script << "select where id = 7"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result).to include("db > Stats:", "tree height: 2")
+    expect(result.any? { |line| line =~ /^splits: [1-9]\d* leaf, 0 internal$/ }).to eq(true)
+    expect(result.any? { |line| line =~ /^insert: 40 calls, mean \d+ ns$/ }).to eq(true)
+    expect(result.any? { |line| line =~ /^scan: 1 calls, mean \d+ ns$/ }).to eq(true)
+    expect(result.any? { |line| line =~ /^get: / }).to eq(false)
+  end
+
+  it 'never uses fewer than the minimum number of cache frames' do
+    result = run_script([".cache", ".exit"], ["--cache-pages=1"])
+    expect(result).to include("frames: 8 (used 2, pinned 0)")
+  end
+
+  it 'reads and updates a memory-mapped database' do
+    script = (1..100).map do |i|
+      "insert #{wide_row(i)}"
+    end
+    script << ".exit"
+    run_script(script)
+
+    script = (101..200).map do |i|
+      "insert #{wide_row(i)}"
+    end
+    script << "select"
+    script << ".cache"
+    script << ".exit"
+    result = run_script(script, ["--mmap", "--cache-pages=8"])
+    expect(result).to include("mmap: 10 pages")
+    expect(result.count { |line| line.end_with?("_)") }).to eq(200)
+
+    result = run_script(["select", ".exit"], ["--mmap"])
+    expect(result.count { |line| line.end_with?("_)") }).to eq(200)
+  end
+
+  it 'reads leaves ahead during a long scan' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select", ".cache", ".exit"], ["--cache-pages=8", "--readahead-pages=16"])
+    expect(result.count { |line| line.end_with?("example.com)") }).to eq(1000)
+    expect(result.any? { |line| line.start_with?("readahead: ") }).to eq(true)
+
+    result = run_script([".cache", ".exit"], ["--readahead-pages=0"])
+    expect(result).to include("readahead: 0 pages")
+  end
+
+  it 'bulk loads sorted rows into packed leaves' do
+    write_rows(1..30, wide: true)
+    result = run_script([
+      ".load load.txt",
+      ".btree",
+      ".exit",
+    ])
+
+    expect(result[0]).to eq("db > Loaded 30 rows.")
+    expect(result.select { |line| line.include?("leaf") || line.include?("internal") }).to eq([
+      "- internal (size 2)",
+      "  - leaf (size 13)",
+      "  - leaf (size 13)",
+      "  - leaf (size 4)",
+    ])
+  end
+
+  it 'bulk loads with a fill factor' do
+    write_rows(1..12, wide: true)
+    result = run_script([
+      ".load load.txt 50",
+      ".btree",
+      ".exit",
+    ])
+
+    expect(result.select { |line| line.include?("leaf") || line.include?("internal") }).to eq([
+      "- internal (size 1)",
+      "  - leaf (size 6)",
+      "  - leaf (size 6)",
+    ])
+  end
+
+  it 'bulk loads locally sorted rows and skips duplicates' do
+    write_rows([3, 1, 2, 6, 5, 4, 2])
+    result = run_script([
+      ".load load.txt",
+      "select",
+      ".exit",
+    ])
+
+    expect(result).to eq([
+      "db > Loaded 6 rows.",
+      "Skipped 1 duplicate keys.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "(4, user4, person4@example.com)",
+      "(5, user5, person5@example.com)",
+      "(6, user6, person6@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'refuses to bulk load into a table that has rows' do
+    write_rows(1..3)
+    result = run_script([
+      "insert 9 user9 person9@example.com",
+      ".load load.txt",
+      ".exit",
+    ])
+
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Bulk load requires an empty table.",
+      "db > ",
+    ])
+  end
+
+  it 'moves pages into free space and truncates the file on vacuum' do
+    write_rows(1..30, wide: true)
+    result = run_script([
+      ".load load.txt",
+      ".vacuum",
+      ".vacuum",
+      ".btree",
+      ".exit",
+    ])
+
+    # The bulk load frees the empty root it replaced
+    expect(result[1]).to eq("db > Released 1 pages.")
+    expect(result[2]).to eq("db > Released 0 pages.")
+    expect(result.select { |line| line.include?("leaf") || line.include?("internal") }).to eq([
+      "- internal (size 2)",
+      "  - leaf (size 13)",
+      "  - leaf (size 13)",
+      "  - leaf (size 4)",
+    ])
+    expect(File.size("test.db")).to eq(5 * 4096)
+
+    result = run_script(["select", ".exit"])
+    expect(result.count { |line| line.end_with?("_)") }).to eq(30)
+  end
+
+  it 'keeps a cursor on its snapshot through inserts, deletes and vacuum' do
+    system("make", "-s", "spec/snapshot_cursors", exception: true)
+    result = `./spec/snapshot_cursors test.db`.split("\n")
+    expect(result).to eq(["ok", "0 problems"])
+
+    `rm -rf test.db test.db-wal`
+    result = `./spec/snapshot_cursors test.db --mmap`.split("\n")
+    expect(result).to eq(["ok", "0 problems"])
+  end
+
+  it 'removes the write-ahead log after a clean exit' do
+    run_script([
+      "insert 1 user1 person1@example.com",
+      ".exit",
+    ])
+    expect(File.exist?("test.db-wal")).to eq(false)
+  end
+
+  it 'recovers committed rows from the write-ahead log after a crash' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    # No .exit, so the process dies at end of input without closing the db
+    result = run_script(script, ["--commit-interval-ms=10"])
+    expect(result.last).to eq("db > Error reading input")
+    expect(File.exist?("test.db-wal")).to eq(true)
+
+    result = run_script(["select", ".exit"])
+    expect(result.length).to eq(52)
+    expect(result[0]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[49]).to eq("(50, user50, person50@example.com)")
+  end
+
+  it 'checkpoints runs of consecutive pages with one write each' do
+    write_rows(1..2000, wide: true)
+    result = run_script([".load load.txt"])
+    expect(result.last).to eq("db > Error reading input")
+
+    # Recovery at open checkpoints what the crash left in the log
+    result = run_script([".stats", ".exit"])
+    checkpoints = result.find { |line| line.start_with?("checkpoints: ") }
+    pages, writes = checkpoints.scan(/\d+/).map(&:to_i)
+    expect(pages > 150).to eq(true)
+    expect(writes).to eq((pages + 63) / 64)
+  end
+
+  it 'logs compressed pages and recovers them after a crash' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".cache"
+    result = run_script(script, ["--compress-wal", "--commit-interval-ms=10"])
+    wal = result.find { |line| line.start_with?("wal: ") }
+    pages, bytes = wal.scan(/\d+/).map(&:to_i)
+    expect(bytes < pages * 4096 / 4).to eq(true)
+    expect(File.exist?("test.db-wal")).to eq(true)
+
+    result = run_script(["select", ".exit"])
+    expect(result.length).to eq(52)
+    expect(result[0]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[49]).to eq("(50, user50, person50@example.com)")
+  end
+
+  it 'commits a transaction as one unit and rejects misplaced statements' do
+    result = run_script([
+      "commit",
+      "begin",
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "select",
+      "commit",
+      "rollback",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Error: No transaction is open.",
+      "db > Executed.",
+      "db > Error: Transaction already open.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Error: No transaction is open.",
+      "db > ",
+    ])
+
+    result = run_script(["select", ".exit"])
+    expect(result.length).to eq(4)
+  end
+
+  it 'rolls back inserts and deletes, including pages spilled from the cache' do
+    script = (1..200).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "begin"
+    script += (201..2000).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete where id between 1 and 150"
+    script << "rollback"
+    script << "select"
+    script << ".exit"
+    result = run_script(script, ["--cache-pages=8"])
+    rows = result.select { |line| line.include?("@example.com") }
+    expect(rows.length).to eq(200)
+    expect(rows.first).to eq("db > (1, user1, person1@example.com)")
+    expect(rows.last).to eq("(200, user200, person200@example.com)")
+
+    result = run_script(["insert 201 user201 person201@example.com", "select", ".exit"])
+    expect(result.length).to eq(204)
+  end
+
+  it 'discards an unfinished transaction after a crash' do
+    script = ["insert 1 user1 person1@example.com", "begin"]
+    script += (2..500).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    result = run_script(script, ["--cache-pages=8"])
+    expect(result.last).to eq("db > Error reading input")
+
+    result = run_script(["select", ".exit"])
+    expect(result).to eq([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps readers on other threads out of transactions that roll back' do
+    system("make", "-s", "spec/transaction_readers", exception: true)
+    result = `./spec/transaction_readers test.db`.split("\n")
+    expect(result).to eq(["ok", "0 problems"])
+  end
+
+  it 'finds rows by email or username through an index kept in sync' do
+    result = run_script([
+      "insert 1 alice shared@example.com",
+      "insert 2 bob bob@example.com",
+      "create index on users(email)",
+      "create index on users(email)",
+      "insert 3 carol shared@example.com",
+      "select where email = shared@example.com",
+      "select where email = shared@example.com and id > 1",
+      "delete where email = shared@example.com and id < 2",
+      "select where email = shared@example.com",
+      "select where username = bob",
+      "create index on users(phone)",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Index already exists.",
+      "db > Executed.",
+      "db > (1, alice, shared@example.com)",
+      "(3, carol, shared@example.com)",
+      "Executed.",
+      "db > (3, carol, shared@example.com)",
+      "Executed.",
+      "db > Deleted 1 rows.",
+      "Executed.",
+      "db > (3, carol, shared@example.com)",
+      "Executed.",
+      "db > (2, bob, bob@example.com)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps an index across reopening and large deletes' do
+    script = (1..1000).map { |i| "insert #{i} user#{i} person#{i % 10}@example.com" }
+    script << "create index on users(email)"
+    script << "delete where id between 1 and 900"
+    script << ".exit"
+    run_script(script, ["--cache-pages=8"])
+
+    write_rows([2000])
+    result = run_script([
+      "select where email = person7@example.com",
+      "create index on users(email)",
+      ".load load.txt",
+      ".exit",
+    ])
+    expect(result).to eq(
+      ["db > (907, user907, person7@example.com)"] +
+      (917..997).step(10).map { |i| "(#{i}, user#{i}, person7@example.com)" } +
+      [
+        "Executed.",
+        "db > Error: Index already exists.",
+        "db > Bulk load requires a table without indexes.",
+        "db > ",
+      ]
+    )
+  end
+
+  it 'indexes any number of rows that share a value' do
+    File.write("load.txt", (1..40000).map { |i| "#{i} user#{i} shared@example.com\n" }.join)
+    result = run_script([
+      ".load load.txt",
+      "create index on users(email)",
+      "insert 40001 user40001 shared@example.com",
+      "select where email = shared@example.com and id > 39998",
+      "delete where id between 1 and 29999",
+      "select where email = shared@example.com and id < 30001",
+      ".check",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Loaded 40000 rows.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (39999, user39999, shared@example.com)",
+      "(40000, user40000, shared@example.com)",
+      "(40001, user40001, shared@example.com)",
+      "Executed.",
+      "db > Deleted 29999 rows.",
+      "Executed.",
+      "db > (30000, user30000, shared@example.com)",
+      "Executed.",
+      "db > No problems found.",
+      "db > ",
+    ])
+  end
+
+  it 'checks a healthy database and finds a corrupted page' do
+    script = (1..2000).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "create index on users(email)"
+    script << "delete where id between 500 and 900"
+    script << ".check 4"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-2..]).to eq(["db > No problems found.", "db > "])
+
+    # Flip a byte in the table's root, which every lookup reads
+    root_page_num = File.binread("test.db", 4, 4).unpack1("V")
+    File.open("test.db", "r+b") do |file|
+      file.seek(root_page_num * 4096 + 2000)
+      byte = file.read(1).ord
+      file.seek(root_page_num * 4096 + 2000)
+      file.write((byte ^ 1).chr)
+    end
+
+    # The pages under the root cannot be reached either
+    result = run_script([".check", ".exit"])
+    expect(result.first).to eq("db > Page #{root_page_num} failed its checksum.")
+    expect(result[-2..]).to eq(["Found 2 problems.", "db > "])
+
+    result = run_script(["select where id = 1000", ".exit"])
+    expect(result).to eq([
+      "db > Page #{root_page_num} failed its checksum. Corrupt file.",
+    ])
+  end
 end
@@ -0,0 +1,202 @@
+/*
+ * A cursor reads the table as it was when it was opened. One is left
+ * open part way through while the table is changed under it: rows are
+ * inserted, a range is deleted and the file is vacuumed. It must still
+ * return exactly its original rows. While it is open the WAL must not
+ * restart, since the cursor may need the page versions in it. Once it is
+ * closed, checkpoints must catch up and the WAL must start over.
+ *
+ *   snapshot_cursors <db file> [--mmap]
+ *
+ * Prints "ok" and the database's problem count once done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../libdb.h"
+
+#define SNAPSHOT_CURSORS_ROWS 20000
+#define SNAPSHOT_CURSORS_BATCH_ROWS 1000
+/* Enough single-row commits to log more pages than a checkpoint waits for */
+#define SNAPSHOT_CURSORS_APPENDS 1000
+#define SNAPSHOT_CURSORS_MAX_WAITS 250
+/* Polls without a page checkpointed before the checkpoint counts as done */
+#define SNAPSHOT_CURSORS_QUIET_WAITS 5
+
+char wal_filename[1024];
+
+void make_row(Row* row, uint32_t id, uint32_t generation) {
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u_%u", id,
+           generation);
+  uint32_t email_length = id * 7 % 200 + 10;
+  memset(row->email, 'a' + id % 26, email_length);
+  row->email[email_length] = '\0';
+}
+
+off_t wal_size() {
+  struct stat wal_stat;
+  return stat(wal_filename, &wal_stat) == 0 ? wal_stat.st_size : 0;
+}
+
+/* Read rows first_id to last_id from the cursor, or say what went wrong */
+bool expect_rows(Cursor* cursor, uint32_t first_id, uint32_t last_id,
+                 uint32_t generation) {
+  Row row;
+  Row expected;
+  for (uint32_t id = first_id; id <= last_id; id++) {
+    make_row(&expected, id, generation);
+    if (!db_cursor_next(cursor, &row)) {
+      printf("Cursor ended before row %u.\n", id);
+      return false;
+    }
+    if (row.id != id || strcmp(row.username, expected.username) != 0 ||
+        strcmp(row.email, expected.email) != 0) {
+      printf("Cursor returned row %u (%s) instead of %u (%s).\n", row.id,
+             row.username, id, expected.username);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool expect_end(Cursor* cursor) {
+  Row row;
+  if (db_cursor_next(cursor, &row)) {
+    printf("Cursor returned row %u past its end.\n", row.id);
+    return false;
+  }
+  return true;
+}
+
+/* The WAL may grow but must never start over */
+bool expect_wal_kept(off_t* size, const char* after) {
+  off_t new_size = wal_size();
+  if (new_size < *size) {
+    printf("The WAL restarted under an open cursor after %s.\n", after);
+    return false;
+  }
+  *size = new_size;
+  return true;
+}
+
+bool change_under_cursor(Table* table, Cursor* cursor) {
+  off_t size = wal_size();
+  Row row;
+  db_delete_range(table, 5000, 15000);
+  if (!expect_wal_kept(&size, "a range delete")) {
+    return false;
+  }
+  for (uint32_t i = 0; i < SNAPSHOT_CURSORS_APPENDS; i++) {
+    make_row(&row, SNAPSHOT_CURSORS_ROWS + 1 + i, 1);
+    db_insert(table, &row);
+  }
+  make_row(&row, 1, 1);
+  db_delete(table, 1);
+  db_insert(table, &row);
+  if (!expect_wal_kept(&size, "inserts")) {
+    return false;
+  }
+  db_delete_range(table, SNAPSHOT_CURSORS_ROWS + 1, UINT32_MAX);
+  if (db_vacuum(table, UINT32_MAX) == 0) {
+    printf("Vacuum released no pages.\n");
+    return false;
+  }
+  if (!expect_wal_kept(&size, "a vacuum")) {
+    return false;
+  }
+  return expect_rows(cursor, 101, SNAPSHOT_CURSORS_ROWS, 0) &&
+         expect_end(cursor);
+}
+
+/*
+With the cursor closed, the WAL thread can fold the whole log into the
+db file. Wait for it to finish, with nothing committed meanwhile. A
+commit landing part way through would leave a tail too short to
+checkpoint, and the WAL could not restart.
+*/
+bool wait_for_checkpoint(Table* table, uint64_t checkpoint_pages) {
+  DbStats stats;
+  uint64_t last_checkpoint_pages = checkpoint_pages;
+  uint32_t quiet_waits = 0;
+  for (uint32_t i = 0; i < SNAPSHOT_CURSORS_MAX_WAITS; i++) {
+    usleep(20000);
+    db_stats(table, &stats);
+    bool quiet = stats.checkpoint_pages > checkpoint_pages &&
+                 stats.checkpoint_pages == last_checkpoint_pages;
+    quiet_waits = quiet ? quiet_waits + 1 : 0;
+    last_checkpoint_pages = stats.checkpoint_pages;
+    if (quiet_waits == SNAPSHOT_CURSORS_QUIET_WAITS) {
+      return true;
+    }
+  }
+  printf("The WAL was not checkpointed once the cursor was closed.\n");
+  return false;
+}
+
+/* Once the log is checkpointed, the next commit restarts it */
+bool expect_wal_restart(Table* table, off_t size_with_cursor) {
+  Row row;
+  make_row(&row, 2, 1);
+  db_delete(table, 2);
+  db_insert(table, &row);
+  if (wal_size() >= size_with_cursor) {
+    printf("The WAL did not restart once the cursor was closed.\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+  DbOptions options = default_db_options();
+  options.use_mmap = argc > 2 && strcmp(argv[2], "--mmap") == 0;
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", argv[1]);
+  Table* table = db_open(argv[1], &options);
+  Row row;
+  for (uint32_t id = 1; id <= SNAPSHOT_CURSORS_ROWS; id++) {
+    if (id % SNAPSHOT_CURSORS_BATCH_ROWS == 1) {
+      db_begin(table);
+    }
+    make_row(&row, id, 0);
+    db_insert(table, &row);
+    if (id % SNAPSHOT_CURSORS_BATCH_ROWS == 0) {
+      db_commit(table);
+    }
+  }
+  /* Reopened, so the rows are read from the db file, or its mapping */
+  db_close(table);
+  table = db_open(argv[1], &options);
+
+  Cursor* cursor = db_cursor_open(table, 0);
+  bool ok = expect_rows(cursor, 1, 100, 0) &&
+            change_under_cursor(table, cursor);
+  off_t size_with_cursor = wal_size();
+  DbStats stats;
+  db_stats(table, &stats);
+  db_cursor_close(cursor);
+  ok = ok && wait_for_checkpoint(table, stats.checkpoint_pages) &&
+       expect_wal_restart(table, size_with_cursor);
+
+  if (ok) {
+    cursor = db_cursor_open(table, 0);
+    ok = expect_rows(cursor, 1, 1, 1) && expect_rows(cursor, 2, 2, 1) &&
+         expect_rows(cursor, 3, 4999, 0) &&
+         expect_rows(cursor, 15001, SNAPSHOT_CURSORS_ROWS, 0) &&
+         expect_end(cursor);
+    db_cursor_close(cursor);
+  }
+
+  if (ok) {
+    printf("ok\n");
+  }
+  printf("%u problems\n", db_check(table, 1));
+  db_close(table);
+  return 0;
+}
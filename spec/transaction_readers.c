@@ -0,0 +1,97 @@
+/*
+ * Readers against a writer that keeps opening and rolling back
+ * transactions. Row TRANSACTION_READERS_DOOMED_ID is inserted by every
+ * transaction and never committed, so no reader may ever find it, and
+ * every row committed before the readers start must stay visible.
+ *
+ *   transaction_readers <db file>
+ *
+ * Prints "ok" and the database's problem count once the writer is done.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../libdb.h"
+
+#define TRANSACTION_READERS_THREADS 8
+#define TRANSACTION_READERS_ROWS 100
+#define TRANSACTION_READERS_ROUNDS 500
+#define TRANSACTION_READERS_DOOMED_ID 5000
+
+typedef struct {
+  Table* table;
+  volatile bool stop;
+  volatile bool failed;
+} Shared;
+
+void make_row(Row* row, uint32_t id) {
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u", id);
+  snprintf(row->email, sizeof(row->email), "person%u@example.com", id);
+}
+
+void* reader_main(void* argument) {
+  Shared* shared = argument;
+  Row row;
+  for (uint32_t i = 0; !shared->stop; i++) {
+    if (db_get(shared->table, TRANSACTION_READERS_DOOMED_ID, &row) ==
+        DB_SUCCESS) {
+      printf("Reader saw uncommitted row %u.\n", row.id);
+      shared->failed = true;
+    }
+    uint32_t id = i % TRANSACTION_READERS_ROWS + 1;
+    if (db_get(shared->table, id, &row) != DB_SUCCESS || row.id != id) {
+      printf("Reader lost committed row %u.\n", id);
+      shared->failed = true;
+    }
+    if (db_find(shared->table, DB_COLUMN_EMAIL,
+                "person5000@example.com", &row, 1) != 0) {
+      printf("Reader found uncommitted row %u.\n", row.id);
+      shared->failed = true;
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+  DbOptions options = default_db_options();
+  Table* table = db_open(argv[1], &options);
+  Row row;
+  for (uint32_t id = 1; id <= TRANSACTION_READERS_ROWS; id++) {
+    make_row(&row, id);
+    db_insert(table, &row);
+  }
+  db_create_index(table, DB_COLUMN_EMAIL);
+
+  Shared shared = {table, false, false};
+  pthread_t readers[TRANSACTION_READERS_THREADS];
+  for (int i = 0; i < TRANSACTION_READERS_THREADS; i++) {
+    pthread_create(&readers[i], NULL, reader_main, &shared);
+  }
+  for (uint32_t i = 0; i < TRANSACTION_READERS_ROUNDS; i++) {
+    make_row(&row, 200 + i);
+    db_insert(table, &row);
+    db_begin(table);
+    make_row(&row, TRANSACTION_READERS_DOOMED_ID);
+    db_insert(table, &row);
+    usleep(20);
+    db_rollback(table);
+  }
+  shared.stop = true;
+  for (int i = 0; i < TRANSACTION_READERS_THREADS; i++) {
+    pthread_join(readers[i], NULL);
+  }
+
+  if (!shared.failed) {
+    printf("ok\n");
+  }
+  printf("%u problems\n", db_check(table, 1));
+  db_close(table);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/* Slots are handed out round robin, in the order threads first count */
+uint32_t stats_next_slot = 0;
+__thread uint32_t stats_thread_slot = STATS_NUM_SLOTS;
+
+Stats* stats_new() {
+  Stats* stats = aligned_alloc(STATS_CACHE_LINE, sizeof(Stats));
+  memset(stats, 0, sizeof(Stats));
+  return stats;
+}
+
+StatsSlot* stats_slot(Stats* stats) {
+  if (stats_thread_slot == STATS_NUM_SLOTS) {
+    stats_thread_slot =
+        __atomic_fetch_add(&stats_next_slot, 1, __ATOMIC_RELAXED) %
+        STATS_NUM_SLOTS;
+  }
+  return &stats->slots[stats_thread_slot];
+}
+
+void stats_add(Stats* stats, StatCounter counter, uint64_t amount) {
+  __atomic_fetch_add(&stats_slot(stats)->counters[counter], amount,
+                     __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Count a call to operation that started at start_ns */
+void stats_record_latency(Stats* stats, DbOperation operation,
+                          uint64_t start_ns) {
+  uint64_t elapsed = stats_now_ns() - start_ns;
+  uint32_t bucket = 63 - __builtin_clzll(elapsed | 1);
+  if (bucket >= DB_LATENCY_BUCKETS) {
+    bucket = DB_LATENCY_BUCKETS - 1;
+  }
+  StatsSlot* slot = stats_slot(stats);
+  __atomic_fetch_add(&slot->latency[operation][bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->total_ns[operation], elapsed, __ATOMIC_RELAXED);
+}
+
+/*
+Add the slots up into total's counters and histograms. Each value is
+read atomically, but updates made meanwhile may be seen in some and not
+in others.
+*/
+void stats_sum(Stats* stats, DbStats* total) {
+  uint64_t counters[STAT_NUM_COUNTERS] = {0};
+  memset(total->calls, 0, sizeof(total->calls));
+  memset(total->total_ns, 0, sizeof(total->total_ns));
+  memset(total->latency, 0, sizeof(total->latency));
+  for (uint32_t i = 0; i < STATS_NUM_SLOTS; i++) {
+    StatsSlot* slot = &stats->slots[i];
+    for (uint32_t c = 0; c < STAT_NUM_COUNTERS; c++) {
+      counters[c] += __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+    }
+    for (uint32_t op = 0; op < DB_NUM_OPERATIONS; op++) {
+      total->total_ns[op] +=
+          __atomic_load_n(&slot->total_ns[op], __ATOMIC_RELAXED);
+      for (uint32_t b = 0; b < DB_LATENCY_BUCKETS; b++) {
+        uint64_t count =
+            __atomic_load_n(&slot->latency[op][b], __ATOMIC_RELAXED);
+        total->latency[op][b] += count;
+        total->calls[op] += count;
+      }
+    }
+  }
+  total->bytes_read = counters[STAT_BYTES_READ];
+  total->bytes_written = counters[STAT_BYTES_WRITTEN];
+  total->leaf_splits = counters[STAT_LEAF_SPLITS];
+  total->internal_splits = counters[STAT_INTERNAL_SPLITS];
+  total->checkpoint_pages = counters[STAT_CHECKPOINT_PAGES];
+  total->checkpoint_writes = counters[STAT_CHECKPOINT_WRITES];
+}
@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "libdb.h"
+
+/*
+ * The counters behind db_stats(). Updates go to one of STATS_NUM_SLOTS
+ * slots, each on cache lines of its own: a thread picks its slot the
+ * first time it counts anything and keeps it, so threads only share
+ * one once there are more of them than slots. Slots are updated with
+ * relaxed atomic adds, which stay correct when they are shared, and a
+ * reader adds them all up.
+ */
+#define STATS_NUM_SLOTS 16
+#define STATS_CACHE_LINE 64
+
+typedef enum {
+  STAT_BYTES_READ,
+  STAT_BYTES_WRITTEN,
+  STAT_LEAF_SPLITS,
+  STAT_INTERNAL_SPLITS,
+  STAT_CHECKPOINT_PAGES,
+  STAT_CHECKPOINT_WRITES,
+  STAT_NUM_COUNTERS,
+} StatCounter;
+
+typedef struct {
+  uint64_t counters[STAT_NUM_COUNTERS];
+  uint64_t total_ns[DB_NUM_OPERATIONS];
+  uint64_t latency[DB_NUM_OPERATIONS][DB_LATENCY_BUCKETS];
+} __attribute__((aligned(STATS_CACHE_LINE))) StatsSlot;
+
+typedef struct {
+  StatsSlot slots[STATS_NUM_SLOTS];
+} Stats;
+
+Stats* stats_new();
+void stats_add(Stats* stats, StatCounter counter, uint64_t amount);
+uint64_t stats_now_ns();
+void stats_record_latency(Stats* stats, DbOperation operation,
+                          uint64_t start_ns);
+void stats_sum(Stats* stats, DbStats* total);
+
+#endif